@@ -0,0 +1,111 @@
+/* Microbenchmark of bitmap scanning and counting on multi-GiB-sized
+   free maps.
+
+   Usage: bitmap-bench [BITS]
+
+   Builds a bitmap of BITS bits (default 8M, the free map of a 4 GiB
+   image) that is all in use except every 1021st bit and the last
+   4096 bits, then times a search for 8 free bits and a count of the
+   free bits.  Each is done both by bitmap_scan() and bitmap_count(),
+   which work a word at a time, and by bit-by-bit reference loops
+   like the ones they replaced, whose results must agree.  The map is
+   made by bitmap_create_in_buf(), so that the times are those of the
+   word scan itself. */
+
+#include "fs/bitmap.h"
+#include "interpreter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define REPEAT 5
+
+int handle_error(enum Error error_code) { return error_code; }
+
+/* Returns the current time in milliseconds. */
+static double now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* Returns the first index of CNT consecutive VALUE bits in B, or
+   BITMAP_ERROR, testing one bit at a time. */
+static size_t scan_bitwise(const struct bitmap *b, size_t cnt, bool value) {
+  size_t n = bitmap_size(b), i, j;
+
+  for (i = 0; i + cnt <= n; i++) {
+    for (j = 0; j < cnt && bitmap_test(b, i + j) == value; j++)
+      continue;
+    if (j == cnt)
+      return i;
+  }
+  return BITMAP_ERROR;
+}
+
+/* Returns the number of VALUE bits in B, testing one bit at a time. */
+static size_t count_bitwise(const struct bitmap *b, bool value) {
+  size_t n = bitmap_size(b), i, cnt = 0;
+
+  for (i = 0; i < n; i++)
+    cnt += bitmap_test(b, i) == value;
+  return cnt;
+}
+
+int main(int argc, char *argv[]) {
+  size_t bits = argc > 1 ? strtoul(argv[1], NULL, 0) : (size_t)8 << 20;
+  size_t scan_ref = 0, scan = 0, count_ref = 0, count = 0, i;
+  double t, scan_ref_ms, scan_ms, count_ref_ms, count_ms;
+  struct bitmap *b;
+  void *buf;
+  int k;
+
+  if (bits <= 4096) {
+    fprintf(stderr, "usage: %s [BITS], BITS > 4096\n", argv[0]);
+    return 1;
+  }
+  buf = malloc(bitmap_buf_size(bits));
+  b = buf != NULL ? bitmap_create_in_buf(bits, buf, bitmap_buf_size(bits))
+                  : NULL;
+  if (b == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  bitmap_set_multiple(b, 0, bits - 4096, true);
+  for (i = 0; i < bits - 4096; i += 1021)
+    bitmap_reset(b, i);
+
+  t = now_ms();
+  for (k = 0; k < REPEAT; k++)
+    scan_ref = scan_bitwise(b, 8, false);
+  scan_ref_ms = (now_ms() - t) / REPEAT;
+
+  t = now_ms();
+  for (k = 0; k < REPEAT; k++)
+    scan = bitmap_scan(b, 0, 8, false);
+  scan_ms = (now_ms() - t) / REPEAT;
+
+  t = now_ms();
+  for (k = 0; k < REPEAT; k++)
+    count_ref = count_bitwise(b, false);
+  count_ref_ms = (now_ms() - t) / REPEAT;
+
+  t = now_ms();
+  for (k = 0; k < REPEAT; k++)
+    count = bitmap_count(b, 0, bits, false);
+  count_ms = (now_ms() - t) / REPEAT;
+
+  printf("%zu bits (%.2f GiB of sectors)\n", bits,
+         bits * 512.0 / (1024 * 1024 * 1024));
+  printf("  scan for 8 free bits: %9.3f ms bit by bit, %9.3f ms by words\n",
+         scan_ref_ms, scan_ms);
+  printf("  count free bits:      %9.3f ms bit by bit, %9.3f ms by words\n",
+         count_ref_ms, count_ms);
+  free(buf);
+  if (scan != scan_ref || count != count_ref) {
+    printf("MISMATCH: scan %zu vs %zu, count %zu vs %zu\n", scan, scan_ref,
+           count, count_ref);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,275 @@
+/* Benchmark of the trigram content index behind find_file.
+
+   Usage: content-index-bench [N]...
+
+   For each N (default 2000), formats a scratch image and fills its
+   root directory with N text files of 1 to 16 KiB, generated from a
+   fixed seed so that every run searches the same corpus.  The words
+   of each file come from a vocabulary of random lowercase words with
+   a skewed distribution, and each file also holds one tag word found
+   in no other file.  Then times:
+
+     - queries without the index, where every file is read;
+     - building the index, saving it and loading it back;
+     - the same queries with the index.
+
+   Queries are for rare words (a tag), medium words (in a few percent
+   of files) and common words (in nearly all of them).  For each kind
+   it reports the average time of a query and how many files the
+   index leaves to be read.  Output of find_file is discarded. */
+
+#include "bench/image.h"
+#include "fs/content-index.h"
+#include "fs/file.h"
+#include "fs/filesys.h"
+#include "fs/fsutil2.h"
+#include "fs/inode.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of words in the vocabulary, a power of 2. */
+#define VOCAB_BITS 12
+#define VOCAB_SIZE (1 << VOCAB_BITS)
+
+/* Largest file in the corpus, in bytes. */
+#define FILE_MAX (16 * 1024)
+
+/* Queries timed for each kind of pattern. */
+#define QUERY_CNT 8
+
+/* Vocabulary, most frequent word first. */
+static char vocab[VOCAB_SIZE][12];
+
+/* State of the xorshift generator. */
+static uint64_t seed;
+
+/* Returns the next pseudo-random number. */
+static uint64_t next_random(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+/* Fills the vocabulary with words of 5 to 10 letters. */
+static void make_vocab(void) {
+  int i, j, len;
+
+  for (i = 0; i < VOCAB_SIZE; i++) {
+    len = 5 + next_random() % 6;
+    for (j = 0; j < len; j++)
+      vocab[i][j] = 'a' + next_random() % 26;
+    vocab[i][len] = '\0';
+  }
+}
+
+/* Returns the index of a random word of the vocabulary.  Picks a
+   power of 2 uniformly and then a word below it, so that the
+   frequency of a word falls off roughly as 1 / its index. */
+static int random_word(void) {
+  int bits = next_random() % (VOCAB_BITS + 1);
+  return next_random() % (1u << bits);
+}
+
+/* Writes the tag word of file I, unique to it, into TAG. */
+static void make_tag(char tag[16], long i) {
+  snprintf(tag, 16, "tag%06ldq", i);
+}
+
+/* Creates file I of the corpus, using BUF as scratch space.
+   Returns false on failure. */
+static bool make_file(long i, char *buf) {
+  size_t size = 1024 + next_random() % (FILE_MAX - 1024), len = 0;
+  int tag_at = next_random() % 64, word_cnt = 0;
+  char name[32], tag[16];
+  struct file *file;
+  bool ok;
+
+  /* Even the smallest file has more than 64 words. */
+  make_tag(tag, i);
+  while (len < size) {
+    const char *word = word_cnt++ == tag_at ? tag : vocab[random_word()];
+    size_t word_len = strlen(word);
+
+    if (len + word_len + 1 > FILE_MAX)
+      break;
+    memcpy(buf + len, word, word_len);
+    len += word_len;
+    buf[len++] = next_random() % 8 == 0 ? '\n' : ' ';
+  }
+
+  snprintf(name, sizeof name, "doc%06ld.txt", i);
+  if (!filesys_create(name, 0, false))
+    return false;
+  file = filesys_open(name);
+  if (file == NULL)
+    return false;
+  ok = file_write_at(file, buf, len, 0) == (offset_t) len;
+  file_close(file);
+  return ok;
+}
+
+/* The patterns searched for, by kind. */
+enum kind { RARE, MEDIUM, COMMON, KIND_CNT };
+static const char *kind_names[KIND_CNT] = {"rare", "medium", "common"};
+static char patterns[KIND_CNT][QUERY_CNT][16];
+
+/* Picks the patterns of each kind for a corpus of N files. */
+static void pick_patterns(long n) {
+  int q;
+
+  for (q = 0; q < QUERY_CNT; q++) {
+    make_tag(patterns[RARE][q], q * n / QUERY_CNT);
+    strcpy(patterns[MEDIUM][q], vocab[VOCAB_SIZE / 4 + q]);
+    strcpy(patterns[COMMON][q], vocab[q]);
+  }
+}
+
+/* Standard output, while it is redirected to /dev/null. */
+static int saved_stdout = -1;
+
+/* Discards standard output until loud() is called. */
+static void quiet(void) {
+  int null = open("/dev/null", O_WRONLY);
+
+  fflush(stdout);
+  saved_stdout = dup(STDOUT_FILENO);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+}
+
+/* Restores standard output after quiet(). */
+static void loud(void) {
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+}
+
+/* Returns how many of the N files of the corpus the content index
+   leaves to be read when searching for PATTERN: all of them if there
+   is no index. */
+static long candidate_cnt(char *pattern, long n) {
+  struct content_query *query = content_index_query(&pattern, 1);
+  char name[32];
+  long cnt = 0, i;
+
+  for (i = 0; i < n; i++) {
+    struct file *file;
+
+    snprintf(name, sizeof name, "doc%06ld.txt", i);
+    file = filesys_open(name);
+    if (file == NULL)
+      continue;
+    if (content_query_may_match(query,
+                                inode_get_inumber(file_get_inode(file))))
+      cnt++;
+    file_close(file);
+  }
+  content_query_free(query);
+  return cnt;
+}
+
+/* Runs the queries of each kind on the N files of the corpus and
+   prints their average time in milliseconds and how many files each
+   of them reads. */
+static void run_queries(const char *label, long n) {
+  int kind, q;
+
+  printf("  %-11s", label);
+  for (kind = 0; kind < KIND_CNT; kind++) {
+    double t = image_now_ms(), ms;
+    long read_cnt = 0;
+
+    quiet();
+    for (q = 0; q < QUERY_CNT; q++)
+      find_file(patterns[kind][q]);
+    loud();
+    ms = (image_now_ms() - t) / QUERY_CNT;
+
+    for (q = 0; q < QUERY_CNT; q++)
+      read_cnt += candidate_cnt(patterns[kind][q], n);
+    printf(" %9.3f ms %6ld", ms, read_cnt / QUERY_CNT);
+  }
+  printf("\n");
+}
+
+/* Runs the benchmark with N files.  Returns 0 if successful. */
+static int run(long n) {
+  double t, build_ms, save_ms, load_ms;
+  char *buf;
+  long i;
+
+  if (!image_open(n * (FILE_MAX / 512 + 1) + 8192))
+    return 1;
+  buf = malloc(FILE_MAX);
+  if (buf == NULL) {
+    image_close();
+    return 1;
+  }
+
+  seed = 0x9e3779b97f4a7c15ull;
+  make_vocab();
+  for (i = 0; i < n; i++)
+    if (!make_file(i, buf)) {
+      fprintf(stderr, "content-index-bench: cannot create file %ld\n", i);
+      free(buf);
+      image_close();
+      return 1;
+    }
+  free(buf);
+  pick_patterns(n);
+
+  printf("%ld files: milliseconds and files read per query\n%13s", n, "");
+  for (i = 0; i < KIND_CNT; i++)
+    printf(" %19s", kind_names[i]);
+  printf("\n");
+  run_queries("no index:", n);
+
+  t = image_now_ms();
+  quiet();
+  build_content_index();
+  loud();
+  build_ms = image_now_ms() - t;
+
+  t = image_now_ms();
+  content_index_close();
+  save_ms = image_now_ms() - t;
+  t = image_now_ms();
+  content_index_open();
+  load_ms = image_now_ms() - t;
+  if (!content_index_exists()) {
+    fprintf(stderr, "content-index-bench: cannot build the index\n");
+    image_close();
+    return 1;
+  }
+
+  printf("  build %.1f ms, save %.1f ms, load %.1f ms\n  ", build_ms,
+         save_ms, load_ms);
+  content_index_print_stats();
+  run_queries("with index:", n);
+  image_close();
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static char *defaults[] = {"2000"};
+  char **counts = argc > 1 ? argv + 1 : defaults;
+  int count_cnt = argc > 1 ? argc - 1 : 1;
+  int i, status = 0;
+
+  for (i = 0; i < count_cnt; i++) {
+    long n = atol(counts[i]);
+
+    if (n <= 0 || n > 20000) {
+      fprintf(stderr, "usage: %s [N]..., 0 < N <= 20000\n", argv[0]);
+      return 1;
+    }
+    if (!image_fork(run, n))
+      status = 1;
+  }
+  return status;
+}
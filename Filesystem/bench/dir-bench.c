@@ -0,0 +1,102 @@
+/* Benchmark of name lookup in large directories.
+
+   Usage: dir-bench [N]...
+
+   For each N (default 1000 and 10000), formats a scratch image and
+   times creating N empty files in the root directory, opening each
+   of them, looking up as many names that do not exist, and removing
+   every other file.  All of these go through the directory's name
+   index, which is built once the root outgrows a linear scan. */
+
+#include "bench/image.h"
+#include "fs/file.h"
+#include "fs/filesys.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Size of the scratch file system partition, in sectors: 32 MiB. */
+#define IMAGE_SECTORS 65536
+
+/* Runs the benchmark with N files.  Returns 0 if successful. */
+static int run(long n) {
+  double t, create_us, hit_us, miss_us, remove_us;
+  char name[24];
+  struct file *file;
+  long i;
+
+  if (!image_open(IMAGE_SECTORS))
+    return 1;
+
+  t = image_now_ms();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "file%06ld", i);
+    if (!filesys_create(name, 0, false)) {
+      fprintf(stderr, "dir-bench: cannot create file %ld\n", i);
+      image_close();
+      return 1;
+    }
+  }
+  create_us = (image_now_ms() - t) * 1e3 / n;
+
+  t = image_now_ms();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "file%06ld", i * 7919 % n);
+    file = filesys_open(name);
+    if (file == NULL) {
+      fprintf(stderr, "dir-bench: cannot open %s\n", name);
+      image_close();
+      return 1;
+    }
+    file_close(file);
+  }
+  hit_us = (image_now_ms() - t) * 1e3 / n;
+
+  t = image_now_ms();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "none%06ld", i);
+    file = filesys_open(name);
+    if (file != NULL) {
+      fprintf(stderr, "dir-bench: opened missing file %s\n", name);
+      image_close();
+      return 1;
+    }
+  }
+  miss_us = (image_now_ms() - t) * 1e3 / n;
+
+  t = image_now_ms();
+  for (i = 0; i < n; i += 2) {
+    snprintf(name, sizeof name, "file%06ld", i);
+    if (!filesys_remove(name)) {
+      fprintf(stderr, "dir-bench: cannot remove %s\n", name);
+      image_close();
+      return 1;
+    }
+  }
+  remove_us = (image_now_ms() - t) * 1e3 / ((n + 1) / 2);
+
+  printf("%6ld entries: create %8.1f us, open %8.1f us, miss %8.1f us, "
+         "remove %8.1f us\n",
+         n, create_us, hit_us, miss_us, remove_us);
+  image_close();
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static char *defaults[] = {"1000", "10000"};
+  char **counts = argc > 1 ? argv + 1 : defaults;
+  int count_cnt = argc > 1 ? argc - 1 : 2;
+  int i, status = 0;
+
+  for (i = 0; i < count_cnt; i++) {
+    long n = atol(counts[i]);
+
+    if (n <= 0 || n > IMAGE_SECTORS / 4) {
+      fprintf(stderr, "usage: %s [N]..., 0 < N <= %d\n", argv[0],
+              IMAGE_SECTORS / 4);
+      return 1;
+    }
+    if (!image_fork(run, n))
+      status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,95 @@
+/* Benchmark of sequential throughput against file size.
+
+   Usage: file-size-bench [MIB]...
+
+   For each size (default 1, 16, 128 and 512 MiB), formats a scratch
+   image with room for the file, writes the file front to back in
+   64 KiB chunks and reads it back the same way.  The read is also
+   timed separately over the first and the last eighth of the file,
+   which show whether lookups slow down as the block map grows
+   deeper. */
+
+#include "bench/image.h"
+#include "fs/file.h"
+#include "fs/filesys.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK (64 * 1024)
+#define MIB (1024 * 1024)
+
+/* Reads LENGTH bytes of FILE from START in CHUNK-sized pieces into
+   BUF.  Returns the throughput in MB/s, or -1 on a short read. */
+static double time_read(struct file *file, char *buf, offset_t start,
+                        offset_t length) {
+  double t = image_now_ms();
+  offset_t ofs;
+
+  for (ofs = start; ofs < start + length; ofs += CHUNK)
+    if (file_read_at(file, buf, CHUNK, ofs) != CHUNK)
+      return -1;
+  return length / 1e3 / (image_now_ms() - t);
+}
+
+/* Runs the benchmark on a file of MIB mebibytes.  Returns 0 if
+   successful. */
+static int run(long mib) {
+  offset_t size = (offset_t)mib * MIB, ofs;
+  double t, write_mbs, read_mbs, first_mbs, last_mbs;
+  struct file *file;
+  char *buf = malloc(CHUNK);
+
+  /* Data sectors, plus an eighth for block maps and free map. */
+  if (buf == NULL || !image_open(size / 512 + size / 512 / 8 + 4096)) {
+    free(buf);
+    return 1;
+  }
+  memset(buf, 'x', CHUNK);
+  if (!filesys_create("f", 0, false) || (file = filesys_open("f")) == NULL) {
+    fprintf(stderr, "file-size-bench: cannot create file\n");
+    image_close();
+    return 1;
+  }
+
+  t = image_now_ms();
+  for (ofs = 0; ofs < size; ofs += CHUNK)
+    if (file_write_at(file, buf, CHUNK, ofs) != CHUNK) {
+      fprintf(stderr, "file-size-bench: short write at %" PROTd "\n", ofs);
+      file_close(file);
+      image_close();
+      return 1;
+    }
+  write_mbs = size / 1e3 / (image_now_ms() - t);
+
+  read_mbs = time_read(file, buf, 0, size);
+  first_mbs = time_read(file, buf, 0, size / 8);
+  last_mbs = time_read(file, buf, size - size / 8, size / 8);
+  printf("%6ld MiB: write %7.1f MB/s, read %7.1f MB/s "
+         "(first eighth %7.1f, last eighth %7.1f)\n",
+         mib, write_mbs, read_mbs, first_mbs, last_mbs);
+
+  file_close(file);
+  image_close();
+  free(buf);
+  return read_mbs < 0 || first_mbs < 0 || last_mbs < 0;
+}
+
+int main(int argc, char *argv[]) {
+  static char *defaults[] = {"1", "16", "128", "512"};
+  char **sizes = argc > 1 ? argv + 1 : defaults;
+  int size_cnt = argc > 1 ? argc - 1 : 4;
+  int i, status = 0;
+
+  for (i = 0; i < size_cnt; i++) {
+    long mib = atol(sizes[i]);
+
+    if (mib <= 0 || mib > 8192) {
+      fprintf(stderr, "usage: %s [MIB]..., 0 < MIB <= 8192\n", argv[0]);
+      return 1;
+    }
+    if (!image_fork(run, mib))
+      status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,84 @@
+/* Benchmark of fsutil calls with many files open.
+
+   Usage: file-table-bench [N]...
+
+   For each N (default 100, 1000 and 5000), formats a scratch image,
+   creates N empty files, opens them all through fsutil_seek(), which
+   keeps them in the open file table, and then times 200000
+   fsutil_size() calls spread over them.  Every such call looks its
+   file up in the table by name, so the time per call shows how that
+   lookup scales with the number of open files. */
+
+#include "bench/image.h"
+#include "fs/fsutil.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Size of the scratch file system partition, in sectors: 16 MiB. */
+#define IMAGE_SECTORS 32768
+
+#define SIZE_CALLS 200000
+
+/* Runs the benchmark with N open files.  Returns 0 if successful. */
+static int run(long n) {
+  char name[24];
+  double t, open_ms, size_ns, close_ms;
+  long i, k;
+
+  if (!image_open(IMAGE_SECTORS))
+    return 1;
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "f%05ld", i);
+    if (fsutil_create(name, 0) != 1) {
+      fprintf(stderr, "file-table-bench: cannot create file %ld\n", i);
+      image_close();
+      return 1;
+    }
+  }
+
+  t = image_now_ms();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "f%05ld", i);
+    fsutil_seek(name, 0);
+  }
+  open_ms = image_now_ms() - t;
+
+  t = image_now_ms();
+  for (k = 0; k < SIZE_CALLS; k++) {
+    snprintf(name, sizeof name, "f%05ld", k * 7919 % n);
+    fsutil_size(name);
+  }
+  size_ns = (image_now_ms() - t) * 1e6 / SIZE_CALLS;
+
+  t = image_now_ms();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof name, "f%05ld", i);
+    fsutil_close(name);
+  }
+  close_ms = image_now_ms() - t;
+
+  printf("%6ld open files: open all %8.1f ms, size %8.0f ns/call, "
+         "close all %8.1f ms\n",
+         n, open_ms, size_ns, close_ms);
+  image_close();
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static char *defaults[] = {"100", "1000", "5000"};
+  char **counts = argc > 1 ? argv + 1 : defaults;
+  int count_cnt = argc > 1 ? argc - 1 : 3;
+  int i, status = 0;
+
+  for (i = 0; i < count_cnt; i++) {
+    long n = atol(counts[i]);
+
+    if (n <= 0 || n > 99999) {
+      fprintf(stderr, "usage: %s [N]..., 0 < N < 100000\n", argv[0]);
+      return 1;
+    }
+    if (!image_fork(run, n))
+      status = 1;
+  }
+  return status;
+}
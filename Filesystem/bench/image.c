@@ -0,0 +1,104 @@
+/* Scratch file system images for the benchmarks.
+
+   Each benchmark formats a fresh image in /tmp, so that its results
+   do not depend on what an existing image happens to hold, and
+   removes it when done.  The block layer can be set up only once per
+   process, so a benchmark that wants several images runs each in a
+   child process through image_fork(). */
+
+#include "bench/image.h"
+#include "fs/filesys.h"
+#include "fs/ide.h"
+#include "interpreter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Path of the open scratch image, or empty. */
+static char image_path[] = "/tmp/fs-benchXXXXXX";
+static bool image_made;
+
+/* Stands in for the shell's error reporter, which fsutil calls. */
+int handle_error(enum Error error_code) { return error_code; }
+
+/* Stores VALUE, LEN bytes wide, into P in little-endian order. */
+static void put_le(uint8_t *p, uint32_t value, int len) {
+  int i;
+
+  for (i = 0; i < len; i++)
+    p[i] = value >> (8 * i);
+}
+
+/* Writes to FD an image whose partition table holds one file system
+   partition of SECTORS sectors, starting at sector 1.  Returns true
+   if successful. */
+static bool make_image(int fd, uint32_t sectors) {
+  uint8_t mbr[512];
+  uint8_t *entry = mbr + 446;
+
+  memset(mbr, 0, sizeof mbr);
+  entry[4] = 0x21; /* Pintos file system partition. */
+  put_le(entry + 8, 1, 4);
+  put_le(entry + 12, sectors, 4);
+  put_le(mbr + 510, 0xaa55, 2);
+  return write(fd, mbr, sizeof mbr) == sizeof mbr &&
+         ftruncate(fd, (off_t)(sectors + 2) * sizeof mbr) == 0;
+}
+
+/* Creates a scratch image with a file system partition of SECTORS
+   sectors and formats it as the file system.  Returns true if
+   successful. */
+bool image_open(uint32_t sectors) {
+  int fd = mkstemp(image_path);
+
+  if (fd < 0 || !make_image(fd, sectors)) {
+    perror("cannot create scratch image");
+    if (fd >= 0) {
+      close(fd);
+      unlink(image_path);
+    }
+    return false;
+  }
+  close(fd);
+  image_made = true;
+  ide_init(image_path);
+  filesys_init(true);
+  return true;
+}
+
+/* Shuts down the file system and removes the scratch image. */
+void image_close(void) {
+  if (!image_made)
+    return;
+  filesys_done();
+  unlink(image_path);
+  image_made = false;
+}
+
+/* Calls RUN(ARG) in a child process and waits for it.  Returns true
+   if RUN returned 0. */
+bool image_fork(int (*run)(long), long arg) {
+  int status;
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0)
+    exit(run(arg));
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+/* Returns the current time in milliseconds. */
+double image_now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
@@ -0,0 +1,14 @@
+#ifndef BENCH_IMAGE_H
+#define BENCH_IMAGE_H
+
+/* Scratch file system images for the benchmarks. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool image_open(uint32_t sectors);
+void image_close(void);
+bool image_fork(int (*run)(long), long arg);
+double image_now_ms(void);
+
+#endif /* bench/image.h */
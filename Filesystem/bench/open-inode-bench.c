@@ -0,0 +1,80 @@
+/* Benchmark of opening and closing inodes with many inodes open.
+
+   Usage: open-inode-bench [N]
+
+   Formats a scratch image, creates N empty inodes (default 10000) and
+   opens them all.  Then times 200000 inode_open()/inode_close() pairs
+   spread over the open inodes, which only have to be found in the open
+   inode table, and, after closing them all again, 200000 pairs on
+   closed inodes, most of which have to be read back in. */
+
+#include "bench/image.h"
+#include "fs/free-map.h"
+#include "fs/inode.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Size of the scratch file system partition, in sectors: 32 MiB. */
+#define IMAGE_SECTORS 65536
+
+#define PAIRS 200000
+
+/* Opens and closes inodes from SECTORS, which has N entries, PAIRS
+   times.  Returns the number of pairs per second. */
+static double time_pairs(const block_sector_t *sectors, long n) {
+  double t = image_now_ms();
+  long k;
+
+  for (k = 0; k < PAIRS; k++)
+    inode_close(inode_open(sectors[k * 7919 % n]));
+  return PAIRS / ((image_now_ms() - t) / 1e3);
+}
+
+/* Runs the benchmark with N inodes.  Returns 0 if successful. */
+static int run(long n) {
+  block_sector_t *sectors = malloc(n * sizeof *sectors);
+  struct inode **inodes = malloc(n * sizeof *inodes);
+  double t, open_ms, hot, cold;
+  long i;
+
+  if (sectors == NULL || inodes == NULL || !image_open(IMAGE_SECTORS)) {
+    free(sectors);
+    free(inodes);
+    return 1;
+  }
+  for (i = 0; i < n; i++)
+    if (!free_map_allocate(1, &sectors[i]) ||
+        !inode_create(sectors[i], 0, false)) {
+      fprintf(stderr, "open-inode-bench: cannot create inode %ld\n", i);
+      image_close();
+      return 1;
+    }
+
+  t = image_now_ms();
+  for (i = 0; i < n; i++)
+    inodes[i] = inode_open(sectors[i]);
+  open_ms = image_now_ms() - t;
+  hot = time_pairs(sectors, n);
+  for (i = 0; i < n; i++)
+    inode_close(inodes[i]);
+  cold = time_pairs(sectors, n);
+
+  printf("%ld inodes: open all %.1f ms\n", n, open_ms);
+  printf("  open/close with all open: %10.0f pairs/s\n", hot);
+  printf("  open/close with all closed: %8.0f pairs/s\n", cold);
+  image_close();
+  free(sectors);
+  free(inodes);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long n = argc > 1 ? atol(argv[1]) : 10000;
+
+  if (n <= 0 || n > IMAGE_SECTORS / 2) {
+    fprintf(stderr, "usage: %s [N], 0 < N <= %d\n", argv[0],
+            IMAGE_SECTORS / 2);
+    return 1;
+  }
+  return run(n) == 0 ? 0 : 1;
+}
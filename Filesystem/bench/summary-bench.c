@@ -0,0 +1,116 @@
+/* Benchmark of the bitmap summary tree against a plain word scan,
+   over free map sizes and fill levels.
+
+   Usage: summary-bench
+
+   For maps of 1M, 4M and 16M bits (images of 512 MiB to 8 GiB) that
+   are full apart from holes of 1 to 4 free bits and one run of 8 free
+   bits at the very end, times a
+   search for 8 free bits in a map made by bitmap_create(), which
+   keeps the summary tree, and in one made by bitmap_create_in_buf(),
+   which does not.  Also reports the cost of a single-bit update of
+   the summarized map, which has to maintain the tree.
+
+   The holes are sized for fills of 50%, 90% and 99%, but a hole that
+   would come within 5 bits of another is dropped, so the fill column
+   reports the fill that was actually reached. */
+
+#include "fs/bitmap.h"
+#include "interpreter.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SCANS 20
+#define FLIPS 100000
+
+int handle_error(enum Error error_code) { return error_code; }
+
+/* Returns the current time in microseconds. */
+static double now_us(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+/* Returns the next number from a fixed xorshift sequence, so that
+   every map of a given size and fill gets the same holes. */
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/* Fills B to about FILL of its bits with holes of 1 to 4 free bits,
+   kept at least 5 bits apart, and frees its last 8 bits. */
+static void fill(struct bitmap *b, double fill) {
+  size_t n = bitmap_size(b);
+  size_t holes = (1 - fill) * n / 2.5, h;
+  uint64_t state = 88172645463325252ull;
+
+  bitmap_set_all(b, true);
+  for (h = 0; h < holes; h++) {
+    size_t pos = 8 + next_random(&state) % (n - 72);
+    size_t len = 1 + next_random(&state) % 4;
+
+    if (bitmap_all(b, pos - 5, len + 10))
+      bitmap_set_multiple(b, pos, len, false);
+  }
+  bitmap_set_multiple(b, n - 8, 8, false);
+}
+
+/* Returns the average time of SCANS searches for 8 free bits in B,
+   in microseconds, and stores the index found in *IDX. */
+static double time_scan(const struct bitmap *b, size_t *idx) {
+  double t = now_us();
+  int k;
+
+  for (k = 0; k < SCANS; k++)
+    *idx = bitmap_scan(b, 0, 8, false);
+  return (now_us() - t) / SCANS;
+}
+
+int main(void) {
+  static const double fills[] = {0.5, 0.9, 0.99};
+  size_t n, f, lin_idx, sum_idx, k;
+  int status = 0;
+
+  printf("%10s %6s %6s %12s %12s %12s\n", "bits", "target", "fill",
+         "linear us", "summary us", "update us");
+  for (n = (size_t)1 << 20; n <= (size_t)1 << 24; n <<= 2)
+    for (f = 0; f < sizeof fills / sizeof *fills; f++) {
+      void *buf = malloc(bitmap_buf_size(n));
+      struct bitmap *lin, *sum;
+      double lin_us, sum_us, update_us, t;
+
+      lin = buf != NULL ? bitmap_create_in_buf(n, buf, bitmap_buf_size(n))
+                        : NULL;
+      sum = bitmap_create(n);
+      if (lin == NULL || sum == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+      }
+      fill(lin, fills[f]);
+      fill(sum, fills[f]);
+
+      lin_us = time_scan(lin, &lin_idx);
+      sum_us = time_scan(sum, &sum_idx);
+      t = now_us();
+      for (k = 0; k < FLIPS; k++)
+        bitmap_flip(sum, k * 7919 % n);
+      update_us = (now_us() - t) / FLIPS;
+
+      printf("%10zu %5.0f%% %5.1f%% %12.1f %12.2f %12.3f\n", n,
+             100 * fills[f], 100.0 * bitmap_count(lin, 0, n, true) / n,
+             lin_us, sum_us, update_us);
+      if (lin_idx != sum_idx) {
+        printf("MISMATCH: %zu vs %zu\n", lin_idx, sum_idx);
+        status = 1;
+      }
+      bitmap_destroy(sum);
+      free(buf);
+    }
+  return status;
+}
@@ -1,4 +1,5 @@
 #include "bitmap.h"
+#include "block.h"
 #include "debug.h"
 #include "file.h"
 #include "round.h"
@@ -26,6 +27,21 @@ typedef unsigned long elem_type;
 struct bitmap {
   size_t bit_cnt;  /* Number of bits. */
   elem_type *bits; /* Elements that represent bits. */
+
+  /* Summary tree over the false bits, or a null pointer if B has
+     none.  SUMMARY[1] is the root, and node N has children 2N and
+     2N + 1; the LEAF_CNT leaves, one per element, follow at
+     SUMMARY[LEAF_CNT].  LEAF_CNT is a power of 2, and leaves past
+     the last element summarize a full element. */
+  struct run_summary *summary;
+  size_t leaf_cnt;
+};
+
+/* Runs of false bits in the span of bits covered by a summary node. */
+struct run_summary {
+  uint32_t prefix;  /* False bits at the start of the span. */
+  uint32_t suffix;  /* False bits at the end of the span. */
+  uint32_t longest; /* Longest run of false bits in the span. */
 };
 
 /* Returns the index of the element that contains the bit
@@ -55,6 +71,214 @@ static inline elem_type last_mask(const struct bitmap *b) {
   return last_bits ? ((elem_type)1 << last_bits) - 1 : (elem_type)-1;
 }
 
+/* Returns a mask with the CNT bits starting at bit OFS of an element
+   turned on.  OFS + CNT must not exceed ELEM_BITS. */
+static inline elem_type range_mask(size_t ofs, size_t cnt) {
+  elem_type ones = cnt < ELEM_BITS ? ((elem_type)1 << cnt) - 1 : (elem_type)-1;
+  return ones << ofs;
+}
+
+/* Returns the number of bits set to true in element E. */
+static inline size_t elem_popcount(elem_type e) {
+  return __builtin_popcountl(e);
+}
+
+/* Returns the index of the first bit at or after START in B that is
+   set to VALUE, or B's size if there is none.  Skips a whole element
+   at a time. */
+static size_t find_next(const struct bitmap *b, size_t start, bool value) {
+  elem_type flip = value ? 0 : (elem_type)-1;
+  size_t idx, last;
+  elem_type e;
+
+  if (start >= b->bit_cnt)
+    return b->bit_cnt;
+
+  idx = elem_idx(start);
+  last = elem_cnt(b->bit_cnt) - 1;
+  e = (b->bits[idx] ^ flip) & ~(bit_mask(start) - 1);
+  while (e == 0) {
+    if (++idx > last)
+      return b->bit_cnt;
+    e = b->bits[idx] ^ flip;
+  }
+
+  start = idx * ELEM_BITS + __builtin_ctzl(e);
+  return start < b->bit_cnt ? start : b->bit_cnt;
+}
+
+/* Returns the index of the last bit before END in B that is set to
+   VALUE, or BITMAP_ERROR if there is none.  Skips a whole element at
+   a time. */
+static size_t find_prev(const struct bitmap *b, size_t end, bool value) {
+  elem_type flip = value ? 0 : (elem_type)-1;
+  size_t idx;
+  elem_type e;
+
+  if (end == 0)
+    return BITMAP_ERROR;
+
+  idx = elem_idx(end - 1);
+  e = (b->bits[idx] ^ flip) & range_mask(0, (end - 1) % ELEM_BITS + 1);
+  while (e == 0) {
+    if (idx-- == 0)
+      return BITMAP_ERROR;
+    e = b->bits[idx] ^ flip;
+  }
+  return idx * ELEM_BITS + ELEM_BITS - 1 - __builtin_clzl(e);
+}
+
+/* Summary tree. */
+
+/* Returns element IDX of B as the summary tree sees it: bits past
+   the end of B, including whole padding elements, read as true so
+   that no run of false bits extends into them. */
+static inline elem_type summary_elem(const struct bitmap *b, size_t idx) {
+  size_t cnt = elem_cnt(b->bit_cnt);
+  if (idx >= cnt)
+    return (elem_type)-1;
+  return idx == cnt - 1 ? b->bits[idx] | ~last_mask(b) : b->bits[idx];
+}
+
+/* Summarizes the false bits of element E. */
+static struct run_summary summarize_elem(elem_type e) {
+  struct run_summary s;
+  elem_type zeros = ~e;
+
+  s.prefix = e ? __builtin_ctzl(e) : ELEM_BITS;
+  s.suffix = e ? __builtin_clzl(e) : ELEM_BITS;
+  for (s.longest = 0; zeros != 0; s.longest++)
+    zeros &= zeros << 1;
+  return s;
+}
+
+/* Recomputes node N of B's summary tree, which spans SPAN bits, from
+   its children. */
+static void summarize_node(struct bitmap *b, size_t n, size_t span) {
+  const struct run_summary *l = &b->summary[2 * n];
+  const struct run_summary *r = &b->summary[2 * n + 1];
+  struct run_summary *s = &b->summary[n];
+  uint32_t half = span / 2;
+  uint32_t across = l->suffix + r->prefix;
+
+  s->prefix = l->prefix == half ? half + r->prefix : l->prefix;
+  s->suffix = r->suffix == half ? half + l->suffix : r->suffix;
+  s->longest = l->longest > r->longest ? l->longest : r->longest;
+  if (across > s->longest)
+    s->longest = across;
+}
+
+/* Brings B's summary tree up to date after a change to elements
+   FIRST through LAST, inclusive. */
+static void summary_update(struct bitmap *b, size_t first, size_t last) {
+  size_t lo = first + b->leaf_cnt, hi = last + b->leaf_cnt;
+  size_t span = ELEM_BITS;
+  size_t n;
+
+  if (b->summary == NULL)
+    return;
+
+  for (n = lo; n <= hi; n++)
+    b->summary[n] = summarize_elem(summary_elem(b, n - b->leaf_cnt));
+  while (lo > 1) {
+    lo /= 2;
+    hi /= 2;
+    span *= 2;
+    for (n = lo; n <= hi; n++)
+      summarize_node(b, n, span);
+  }
+}
+
+/* Gives B a summary tree, if memory allows.  Bitmaps without one
+   work the same, but scan for false bits linearly. */
+static void summary_create(struct bitmap *b) {
+  size_t cnt = elem_cnt(b->bit_cnt);
+
+  b->summary = NULL;
+  b->leaf_cnt = 1;
+  if (cnt == 0 || b->bit_cnt > UINT32_MAX / 2)
+    return;
+  while (b->leaf_cnt < cnt)
+    b->leaf_cnt *= 2;
+  b->summary = malloc(2 * b->leaf_cnt * sizeof *b->summary);
+  if (b->summary != NULL)
+    summary_update(b, 0, b->leaf_cnt - 1);
+}
+
+/* Finds the first run of CNT false bits in B that starts at or
+   after START, within the SPAN bits from LO covered by summary node
+   N.  *RUN is the length of the run of false bits at or after START
+   that ends at LO; on return it is the run that ends at LO + SPAN.
+   Returns the start of the run found, or BITMAP_ERROR.
+
+   Nodes whose longest run is too short are passed over whole, so
+   the search visits O(log n) nodes per level of the tree. */
+static size_t summary_scan(const struct bitmap *b, size_t n, size_t lo,
+                           size_t span, size_t start, size_t cnt,
+                           size_t *run) {
+  const struct run_summary *s = &b->summary[n];
+  size_t found, i;
+
+  if (lo + span <= start) {
+    *run = 0;
+    return BITMAP_ERROR;
+  }
+  if (lo >= start) {
+    if (*run + s->prefix >= cnt)
+      return lo - *run;
+    if (s->longest < cnt) {
+      *run = s->suffix == span ? *run + span : s->suffix;
+      return BITMAP_ERROR;
+    }
+  }
+
+  if (n >= b->leaf_cnt) {
+    elem_type e = summary_elem(b, n - b->leaf_cnt);
+    for (i = lo > start ? lo : start; i < lo + span; i++) {
+      if (e & bit_mask(i))
+        *run = 0;
+      else if (++*run >= cnt)
+        return i + 1 - cnt;
+    }
+    return BITMAP_ERROR;
+  }
+
+  found = summary_scan(b, 2 * n, lo, span / 2, start, cnt, run);
+  if (found == BITMAP_ERROR)
+    found = summary_scan(b, 2 * n + 1, lo + span / 2, span / 2, start, cnt,
+                         run);
+  return found;
+}
+
+/* Returns the index of the last true bit before END in B, or
+   BITMAP_ERROR if there is none, climbing B's summary tree from the
+   element that holds bit END - 1.  Each left sibling on the way up is
+   either all false, and passed over whole, or holds the answer in its
+   suffix, so the walk visits O(log n) nodes. */
+static size_t summary_find_prev(const struct bitmap *b, size_t end) {
+  size_t idx, n, lo, span;
+  elem_type e;
+
+  if (end == 0)
+    return BITMAP_ERROR;
+
+  idx = elem_idx(end - 1);
+  e = summary_elem(b, idx) & range_mask(0, (end - 1) % ELEM_BITS + 1);
+  if (e != 0)
+    return idx * ELEM_BITS + ELEM_BITS - 1 - __builtin_clzl(e);
+
+  lo = idx * ELEM_BITS;
+  span = ELEM_BITS;
+  for (n = idx + b->leaf_cnt; n > 1; n /= 2, span *= 2)
+    if (n % 2 == 1) {
+      const struct run_summary *left = &b->summary[n - 1];
+      if (left->suffix < span)
+        return lo - left->suffix - 1;
+      lo -= span;
+    }
+  return BITMAP_ERROR;
+}
+
 /* Creation and destruction. */
 
 /* Initializes B to be a bitmap of BIT_CNT bits
@@ -68,6 +292,7 @@ struct bitmap *bitmap_create(size_t bit_cnt) {
     b->bits = malloc(byte_cnt(bit_cnt));
     if (b->bits != NULL || bit_cnt == 0) {
       memset(b->bits, 0, byte_cnt(bit_cnt));
+      summary_create(b);
       bitmap_set_all(b, false);
       return b;
     }
@@ -87,6 +312,8 @@ struct bitmap *bitmap_create_in_buf(size_t bit_cnt, void *block,
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *)(b + 1);
+  b->summary = NULL;
+  b->leaf_cnt = 1;
   bitmap_set_all(b, false);
   return b;
 }
@@ -100,6 +327,7 @@ struct bitmap *bitmap_create_from_buf(size_t bit_cnt, uint8_t *buf) {
   ASSERT(b->bits != NULL);
 
   memcpy(b->bits, buf, byte_cnt(bit_cnt));
+  summary_update(b, 0, b->leaf_cnt - 1);
 
   return b;
 }
@@ -115,6 +343,7 @@ size_t bitmap_buf_size(size_t bit_cnt) {
    bitmap_create_preallocated(). */
 void bitmap_destroy(struct bitmap *b) {
   if (b != NULL) {
+    free(b->summary);
     free(b->bits);
     free(b);
   }
@@ -125,7 +354,13 @@ void bitmap_destroy(struct bitmap *b) {
 /* Returns the number of bits in B. */
 size_t bitmap_size(const struct bitmap *b) { return b->bit_cnt; }
 
-void *bitmap_get_bits(struct bitmap *b) { return b->bits; }
+/* Returns B's elements for the caller to change directly.  B stops
+   keeping a summary tree, since it can no longer see the changes. */
+void *bitmap_get_bits(struct bitmap *b) {
+  free(b->summary);
+  b->summary = NULL;
+  return b->bits;
+}
 
 /* Setting and testing single bits. */
 
@@ -145,6 +380,7 @@ void bitmap_mark(struct bitmap *b, size_t bit_idx) {
   elem_type mask = bit_mask(bit_idx);
 
   b->bits[idx] |= mask;
+  summary_update(b, idx, idx);
 }
 
 /* Sets the bit numbered BIT_IDX in B to false. */
@@ -153,6 +389,7 @@ void bitmap_reset(struct bitmap *b, size_t bit_idx) {
   elem_type mask = bit_mask(bit_idx);
 
   b->bits[idx] &= ~mask;
+  summary_update(b, idx, idx);
 }
 
 /* Toggles the bit numbered IDX in B;
@@ -163,6 +400,7 @@ void bitmap_flip(struct bitmap *b, size_t bit_idx) {
   elem_type mask = bit_mask(bit_idx);
 
   b->bits[idx] ^= mask;
+  summary_update(b, idx, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -184,47 +422,57 @@ void bitmap_set_all(struct bitmap *b, bool value) {
 /* Sets the CNT bits starting at START in B to VALUE. */
 void bitmap_set_multiple(struct bitmap *b, size_t start, size_t cnt,
                          bool value) {
-  size_t i;
+  size_t end = start + cnt;
 
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
   ASSERT(start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set(b, start + i, value);
+  while (start < end) {
+    size_t ofs = start % ELEM_BITS;
+    size_t n = end - start < ELEM_BITS - ofs ? end - start : ELEM_BITS - ofs;
+    elem_type mask = range_mask(ofs, n);
+
+    if (value)
+      b->bits[elem_idx(start)] |= mask;
+    else
+      b->bits[elem_idx(start)] &= ~mask;
+    start += n;
+  }
+  if (cnt > 0)
+    summary_update(b, elem_idx(end - cnt), elem_idx(end - 1));
 }
 
 /* Returns the number of bits in B between START and START + CNT,
    exclusive, that are set to VALUE. */
 size_t bitmap_count(const struct bitmap *b, size_t start, size_t cnt,
                     bool value) {
-  size_t i, value_cnt;
+  size_t end = start + cnt;
+  size_t ones = 0;
 
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
   ASSERT(start + cnt <= b->bit_cnt);
 
-  value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test(b, start + i) == value)
-      value_cnt++;
-  return value_cnt;
+  while (start < end) {
+    size_t ofs = start % ELEM_BITS;
+    size_t n = end - start < ELEM_BITS - ofs ? end - start : ELEM_BITS - ofs;
+
+    ones += elem_popcount(b->bits[elem_idx(start)] & range_mask(ofs, n));
+    start += n;
+  }
+  return value ? ones : cnt - ones;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
    exclusive, are set to VALUE, and false otherwise. */
 bool bitmap_contains(const struct bitmap *b, size_t start, size_t cnt,
                      bool value) {
-  size_t i;
-
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
   ASSERT(start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test(b, start + i) == value)
-      return true;
-  return false;
+  return cnt > 0 && find_next(b, start, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -249,22 +497,57 @@ bool bitmap_all(const struct bitmap *b, size_t start, size_t cnt) {
 
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
-   VALUE.  If there is no such group, returns BITMAP_ERROR. */
+   VALUE.  If there is no such group, returns BITMAP_ERROR.
+
+   Searches for false bits go through B's summary tree, if it has
+   one, in logarithmic time.  Otherwise the search jumps from one run
+   of VALUE bits to the next instead of testing every candidate
+   index, so the cost is linear in the number of elements rather than
+   in bits times CNT. */
 size_t bitmap_scan(const struct bitmap *b, size_t start, size_t cnt,
                    bool value) {
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) {
-    size_t last = b->bit_cnt - cnt;
-    size_t i;
-    for (i = start; i <= last; i++)
-      if (!bitmap_contains(b, i, cnt, !value))
-        return i;
+  if (cnt == 0)
+    return start;
+  if (!value && b->summary != NULL) {
+    size_t run = 0;
+    return summary_scan(b, 1, 0, b->leaf_cnt * ELEM_BITS, start, cnt, &run);
+  }
+  while (cnt <= b->bit_cnt - start) {
+    size_t run_start = find_next(b, start, value);
+    if (cnt > b->bit_cnt - run_start)
+      break;
+    size_t run_end = find_next(b, run_start, !value);
+    if (run_end - run_start >= cnt)
+      return run_start;
+    start = run_end;
   }
   return BITMAP_ERROR;
 }
 
+/* Returns the index of the first bit of the run of VALUE bits in B
+   that ends just before END: the smallest index I such that bits I
+   through END - 1 are all VALUE, which is END itself if bit END - 1
+   is not VALUE.
+
+   Runs of false bits are found through B's summary tree, if it has
+   one, in logarithmic time; otherwise the search goes back an
+   element at a time. */
+size_t bitmap_run_start(const struct bitmap *b, size_t end, bool value) {
+  size_t prev;
+
+  ASSERT(b != NULL);
+  ASSERT(end <= b->bit_cnt);
+
+  if (!value && b->summary != NULL)
+    prev = summary_find_prev(b, end);
+  else
+    prev = find_prev(b, end, !value);
+  return prev == BITMAP_ERROR ? 0 : prev + 1;
+}
+
 /* Finds the first group of CNT consecutive bits in B at or after
    START that are all set to VALUE, flips them all to !VALUE,
    and returns the index of the first bit in the group.
@@ -291,6 +574,7 @@ bool bitmap_read(struct bitmap *b, struct file *file) {
     offset_t size = byte_cnt(b->bit_cnt);
     success = file_read_at(file, b->bits, size, 0) == size;
     b->bits[elem_cnt(b->bit_cnt) - 1] &= last_mask(b);
+    summary_update(b, 0, b->leaf_cnt - 1);
   }
   return success;
 }
@@ -303,6 +587,28 @@ bool bitmap_write(const struct bitmap *b, struct file *file) {
   return file_write_at(file, b->bits, size, 0) == size;
 }
 
+/* Writes the part of B that holds bits START through START + CNT,
+   exclusive, to FILE, widened to whole sectors of FILE so that each
+   sector touched is rewritten once.  Returns true if successful,
+   false otherwise. */
+bool bitmap_write_range(const struct bitmap *b, struct file *file,
+                        size_t start, size_t cnt) {
+  ASSERT(start <= b->bit_cnt);
+  ASSERT(start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return true;
+
+  offset_t size = byte_cnt(b->bit_cnt);
+  offset_t first = ROUND_DOWN(start / CHAR_BIT, BLOCK_SECTOR_SIZE);
+  offset_t last = ROUND_UP(DIV_ROUND_UP(start + cnt, CHAR_BIT),
+                           BLOCK_SECTOR_SIZE);
+  if (last > size)
+    last = size;
+  return file_write_at(file, (const uint8_t *)b->bits + first, last - first,
+                       first) == last - first;
+}
+
 /* Debugging. */
 
 /* Dumps the contents of B to the console as hexadecimal. */
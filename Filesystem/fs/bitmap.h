@@ -39,12 +39,15 @@ bool bitmap_all(const struct bitmap *, size_t start, size_t cnt);
 #define BITMAP_ERROR UINT32_MAX
 size_t bitmap_scan(const struct bitmap *, size_t start, size_t cnt, bool);
 size_t bitmap_scan_and_flip(struct bitmap *, size_t start, size_t cnt, bool);
+size_t bitmap_run_start(const struct bitmap *, size_t end, bool);
 
 /* File input and output. */
 struct file;
 size_t bitmap_file_size(const struct bitmap *);
 bool bitmap_read(struct bitmap *, struct file *);
 bool bitmap_write(const struct bitmap *, struct file *);
+bool bitmap_write_range(const struct bitmap *, struct file *, size_t start,
+                        size_t cnt);
 
 /* Debugging. */
 void bitmap_dump(const struct bitmap *);
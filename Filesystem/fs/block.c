@@ -55,6 +55,28 @@ void block_write(struct block *block, block_sector_t sector,
   block->write_cnt++;
 }
 
+/* Reads the CNT sectors from SECTOR on BLOCK into BUFFER, which
+   must have room for CNT * BLOCK_SECTOR_SIZE bytes, with as few
+   device reads as the driver can.  Unlike block_read(), may be
+   called from several threads at once. */
+void block_read_run(struct block *block, block_sector_t sector, size_t cnt,
+                    void *buffer) {
+  ASSERT(block != NULL);
+  if (cnt == 0)
+    return;
+  check_sector(block, sector);
+  check_sector(block, sector + cnt - 1);
+  block->ops->read_run(block->aux, sector, cnt, buffer);
+  __atomic_fetch_add(&block->read_cnt, cnt, __ATOMIC_RELAXED);
+}
+
+/* Prints statistics for the hard drive. */
+void block_print_stats(void) {
+  if (hard_drive != NULL)
+    printf("%s: %llu reads, %llu writes\n", hard_drive->name,
+           hard_drive->read_cnt, hard_drive->write_cnt);
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t block_size(struct block *block) { return block->size; }
 
@@ -29,13 +29,18 @@ void block_set_hd(struct block *);
 block_sector_t block_size(struct block *);
 void block_read(struct block *, block_sector_t, void *);
 void block_write(struct block *, block_sector_t, const void *);
+void block_read_run(struct block *, block_sector_t, size_t cnt, void *);
 const char *block_name(struct block *);
 
+/* Statistics. */
+void block_print_stats(void);
+
 /* Lower-level interface to block device drivers. */
 
 struct block_operations {
   void (*read)(void *aux, block_sector_t, void *buffer);
   void (*write)(void *aux, block_sector_t, const void *buffer);
+  void (*read_run)(void *aux, block_sector_t, size_t cnt, void *buffer);
 };
 
 struct block *block_register(const char *name, const char *fname,
@@ -1,6 +1,7 @@
 #include "cache.h"
 #include "debug.h"
 #include "filesys.h"
+#include <pthread.h>
 #include <string.h>
 
 #define BUFFER_CACHE_SIZE 64
@@ -18,6 +19,10 @@ struct buffer_cache_entry_t {
 /* Buffer cache entries. */
 static struct buffer_cache_entry_t cache[BUFFER_CACHE_SIZE];
 
+/* Serializes cache and device access between the shell and the
+   background reclaimer in inode.c. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void buffer_cache_init(void) {
   // initialize entries
   size_t i;
@@ -37,15 +42,19 @@ static void buffer_cache_flush(struct buffer_cache_entry_t *entry) {
   }
 }
 
-void buffer_cache_close(void) {
+void buffer_cache_sync(void) {
   size_t i;
+  pthread_mutex_lock(&cache_lock);
   for (i = 0; i < BUFFER_CACHE_SIZE; ++i) {
     if (cache[i].occupied == false)
       continue;
     buffer_cache_flush(&(cache[i]));
   }
+  pthread_mutex_unlock(&cache_lock);
 }
 
+void buffer_cache_close(void) { buffer_cache_sync(); }
+
 /**
  * Lookup the cache entry, and returns the pointer of buffer_cache_entry_t,
  * or NULL in case of cache miss. (simply traverse the cache entries)
@@ -99,6 +108,7 @@ static struct buffer_cache_entry_t *buffer_cache_evict(void) {
 }
 
 void buffer_cache_read(block_sector_t sector, void *target) {
+  pthread_mutex_lock(&cache_lock);
   struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
   if (slot == NULL) {
     // cache miss: need eviction.
@@ -115,24 +125,27 @@ void buffer_cache_read(block_sector_t sector, void *target) {
   // copy the buffer data into memory.
   slot->access = true;
   memcpy(target, slot->buffer, BLOCK_SECTOR_SIZE);
+  pthread_mutex_unlock(&cache_lock);
 }
 
 void buffer_cache_write(block_sector_t sector, const void *source) {
+  pthread_mutex_lock(&cache_lock);
   struct buffer_cache_entry_t *slot = buffer_cache_lookup(sector);
   if (slot == NULL) {
     // cache miss: need eviction.
     slot = buffer_cache_evict();
     ASSERT(slot != NULL && slot->occupied == false);
 
-    // fill in the cache entry.
+    // fill in the cache entry.  The whole sector is overwritten
+    // below, so there is no need to read it from disk first.
     slot->occupied = true;
     slot->disk_sector = sector;
     slot->dirty = false;
-    block_read(fs_device, sector, slot->buffer);
   }
 
   // copy the data form memory into the buffer cache.
   slot->access = true;
   slot->dirty = true;
   memcpy(slot->buffer, source, BLOCK_SECTOR_SIZE);
+  pthread_mutex_unlock(&cache_lock);
 }
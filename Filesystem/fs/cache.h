@@ -8,6 +8,12 @@
 void buffer_cache_init(void);
 void buffer_cache_close(void);
 
+/**
+ * Writes every dirty cache entry back to disk, so that writes made
+ * before the call reach the disk before any made after it.
+ */
+void buffer_cache_sync(void);
+
 /**
  * Read SECTOR_SIZE bytes of data starting from the disk sector
  * specified by 'sector', into `target` (user memory address).
@@ -0,0 +1,749 @@
+#include "content-index.h"
+#include "debug.h"
+#include "free-map.h"
+#include "hash.h"
+#include "inode.h"
+#include "off_t.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Content index.
+
+   An optional inverted index from each trigram, a run of three
+   bytes, to the files that contain it.  It lets find_file skip
+   every file that lacks one of the trigrams of a pattern.  The
+   index lives in a hidden inode, whose sector is kept after the
+   bitmap in the free map file, and is held in memory while the file
+   system is mounted.
+
+   The index may only err on the side of a file matching.  A file it
+   does not cover, because the file was written to since it was
+   indexed or was never indexed, is always searched, and is indexed
+   again the next time find_file reads it in full.  Trigrams with a
+   null byte are left out, as patterns cannot contain one.  A file
+   with too many distinct trigrams to be worth indexing, typically
+   binary data, is covered but always searched.
+
+   Each covered file has an id, and postings list ids in increasing
+   order.  Indexing a file gives it a new id, above all others, so
+   that postings are only ever appended to; a file that changes or
+   is removed just loses its id, and the stale entries it leaves in
+   postings are dropped when the index is written back.
+
+   On disk the index is a header, the sector and flags of each file
+   in id order, and then the postings in trigram order, each as the
+   gap from the previous trigram, the number of files and the gaps
+   between their ids, in the variable-length encoding of
+   put_varint().  From the first change after the index is loaded
+   until it is written back at shutdown, the header on disk says
+   CONTENT_INDEX_OPEN, so that an index left behind by a crash is
+   discarded, not trusted. */
+#define CONTENT_INDEX_MAGIC 0x58444943 /* "CIDX" */
+#define CONTENT_INDEX_CLEAN 1
+#define CONTENT_INDEX_OPEN 2
+
+/* A file with more distinct trigrams than CONTENT_INDEX_MAX_TRIGRAMS,
+   or than CONTENT_INDEX_NOISE_MIN and one per two bytes, is always
+   searched.  Source code and text have about one per eight. */
+#define CONTENT_INDEX_MAX_TRIGRAMS (1 << 15)
+#define CONTENT_INDEX_NOISE_MIN 4096
+
+/* Number of possible trigrams. */
+#define TRIGRAM_CNT (1 << 24)
+
+struct content_index_header {
+  uint32_t magic;       /* CONTENT_INDEX_MAGIC. */
+  uint32_t state;       /* CONTENT_INDEX_CLEAN or CONTENT_INDEX_OPEN. */
+  uint32_t file_cnt;    /* File records that follow. */
+  uint32_t posting_cnt; /* Postings after the file records. */
+};
+
+/* On-disk file record.  Its position is its id. */
+struct content_index_record {
+  block_sector_t sector; /* Inode of the file. */
+  uint32_t all;          /* Always searched? */
+};
+
+/* A file covered by the index. */
+struct indexed_file {
+  struct hash_elem elem; /* Element in indexed_files. */
+  block_sector_t sector; /* Inode of the file. */
+  uint32_t id;           /* Id in postings. */
+  bool all;              /* Too many trigrams: always searched. */
+};
+
+/* The files that contain a trigram. */
+struct posting {
+  struct hash_elem elem; /* Element in postings. */
+  uint32_t trigram;
+  uint32_t *ids; /* Increasing file ids, some maybe stale. */
+  size_t id_cnt;
+  size_t id_cap;
+};
+
+/* The distinct trigrams of a file. */
+struct trigram_set {
+  uint8_t *seen;      /* One bit per possible trigram. */
+  uint32_t *trigrams; /* Trigrams seen, in the order first seen. */
+  size_t cnt;
+  bool overflow;   /* More than CONTENT_INDEX_MAX_TRIGRAMS? */
+  uint32_t window; /* Last three bytes fed, the latest lowest. */
+  size_t length;   /* Bytes fed so far. */
+};
+
+/* Files that may contain any of CNT patterns. */
+struct content_query {
+  size_t cnt;
+  uint32_t **ids; /* Per pattern: increasing ids of files with all of
+                     its trigrams, or NULL if it has none. */
+  size_t *id_cnt;
+};
+
+static struct inode *index_inode; /* Open index, or NULL if none. */
+static struct hash indexed_files;
+static struct hash postings;
+static uint32_t next_id;     /* Id for the next file indexed. */
+static size_t posting_total; /* Sum of id_cnt over all postings. */
+static bool changed;         /* Differs from the copy on disk? */
+
+static unsigned indexed_file_hash(const struct hash_elem *e, void *aux UNUSED) {
+  return hash_int(hash_entry(e, struct indexed_file, elem)->sector);
+}
+
+static bool indexed_file_less(const struct hash_elem *a,
+                              const struct hash_elem *b, void *aux UNUSED) {
+  return hash_entry(a, struct indexed_file, elem)->sector <
+         hash_entry(b, struct indexed_file, elem)->sector;
+}
+
+static void indexed_file_free(struct hash_elem *e, void *aux UNUSED) {
+  free(hash_entry(e, struct indexed_file, elem));
+}
+
+static unsigned posting_hash(const struct hash_elem *e, void *aux UNUSED) {
+  return hash_int(hash_entry(e, struct posting, elem)->trigram);
+}
+
+static bool posting_less(const struct hash_elem *a, const struct hash_elem *b,
+                         void *aux UNUSED) {
+  return hash_entry(a, struct posting, elem)->trigram <
+         hash_entry(b, struct posting, elem)->trigram;
+}
+
+static void posting_free(struct hash_elem *e, void *aux UNUSED) {
+  struct posting *p = hash_entry(e, struct posting, elem);
+  free(p->ids);
+  free(p);
+}
+
+/* qsort() comparison of two file records by id. */
+static int compare_file_ids(const void *a_, const void *b_) {
+  const struct indexed_file *a = *(struct indexed_file *const *)a_;
+  const struct indexed_file *b = *(struct indexed_file *const *)b_;
+  return a->id < b->id ? -1 : a->id > b->id;
+}
+
+/* qsort() comparison of two postings by trigram. */
+static int compare_posting_trigrams(const void *a_, const void *b_) {
+  const struct posting *a = *(struct posting *const *)a_;
+  const struct posting *b = *(struct posting *const *)b_;
+  return a->trigram < b->trigram ? -1 : a->trigram > b->trigram;
+}
+
+/* Returns true if X is one of the CNT sorted values in ARR. */
+static bool sorted_contains(const uint32_t *arr, size_t cnt, uint32_t x) {
+  size_t lo = 0, hi = cnt;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (arr[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < cnt && arr[lo] == x;
+}
+
+/* Stores X at P in seven bits per byte, low bits first, with the top
+   bit set on every byte but the last.  Returns the end of X. */
+static uint8_t *put_varint(uint8_t *p, uint32_t x) {
+  while (x >= 0x80) {
+    *p++ = x | 0x80;
+    x >>= 7;
+  }
+  *p++ = x;
+  return p;
+}
+
+/* Reads a put_varint() value at *P, before END, into *X and
+   advances *P past it.  Returns false if it runs past END. */
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint32_t *x) {
+  *x = 0;
+  for (int shift = 0; *p < end && shift < 32; shift += 7) {
+    uint8_t byte = *(*p)++;
+    *x |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/* Creates a new, empty trigram set.  Returns a null pointer if out
+   of memory. */
+struct trigram_set *trigram_set_create(void) {
+  struct trigram_set *set = calloc(1, sizeof *set);
+  if (set == NULL)
+    return NULL;
+  set->seen = calloc(TRIGRAM_CNT / 8, 1);
+  set->trigrams = malloc(CONTENT_INDEX_MAX_TRIGRAMS * sizeof *set->trigrams);
+  if (set->seen == NULL || set->trigrams == NULL) {
+    trigram_set_destroy(set);
+    return NULL;
+  }
+  return set;
+}
+
+/* Destroys SET. */
+void trigram_set_destroy(struct trigram_set *set) {
+  if (set != NULL) {
+    free(set->seen);
+    free(set->trigrams);
+    free(set);
+  }
+}
+
+/* Empties SET, to collect the trigrams of another file. */
+static void trigram_set_clear(struct trigram_set *set) {
+  for (size_t i = 0; i < set->cnt; i++)
+    set->seen[set->trigrams[i] / 8] = 0;
+  set->cnt = 0;
+  set->overflow = false;
+  set->window = 0;
+  set->length = 0;
+}
+
+/* Adds the trigrams of the SIZE bytes at BUFFER to SET, which takes
+   them as following on from the bytes fed to it before. */
+void trigram_set_feed(struct trigram_set *set, const void *buffer,
+                      size_t size) {
+  const uint8_t *p = buffer;
+  uint32_t window = set->window;
+  size_t i = 0;
+
+  /* The first two bytes of a file only start a window. */
+  for (; i < size && set->length + i < 2; i++)
+    window = (window << 8) | p[i];
+  for (; i < size && !set->overflow; i++) {
+    window = ((window << 8) | p[i]) & (TRIGRAM_CNT - 1);
+    if ((window & 0xff) == 0 || (window & 0xff00) == 0 ||
+        (window & 0xff0000) == 0)
+      continue;
+    if (set->seen[window / 8] & (1 << (window % 8)))
+      continue;
+    if (set->cnt == CONTENT_INDEX_MAX_TRIGRAMS)
+      set->overflow = true;
+    else {
+      set->seen[window / 8] |= 1 << (window % 8);
+      set->trigrams[set->cnt++] = window;
+    }
+  }
+  set->window = window;
+  set->length += size;
+}
+
+/* Returns true if the file whose trigrams SET holds is not worth
+   indexing. */
+static bool trigram_set_is_noise(const struct trigram_set *set) {
+  return set->overflow ||
+         (set->cnt > CONTENT_INDEX_NOISE_MIN && set->cnt > set->length / 2);
+}
+
+/* Returns the file record for SECTOR, or a null pointer. */
+static struct indexed_file *file_find(block_sector_t sector) {
+  struct indexed_file key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find(&indexed_files, &key.elem);
+  return e != NULL ? hash_entry(e, struct indexed_file, elem) : NULL;
+}
+
+/* Returns the posting for TRIGRAM, or a null pointer. */
+static struct posting *posting_find(uint32_t trigram) {
+  struct posting key;
+  struct hash_elem *e;
+
+  key.trigram = trigram;
+  e = hash_find(&postings, &key.elem);
+  return e != NULL ? hash_entry(e, struct posting, elem) : NULL;
+}
+
+/* Records that the file with ID, which is above every id in the
+   index so far, contains TRIGRAM.  Returns false if out of memory. */
+static bool posting_append(uint32_t trigram, uint32_t id) {
+  struct posting *p = posting_find(trigram);
+
+  if (p == NULL) {
+    p = calloc(1, sizeof *p);
+    if (p == NULL)
+      return false;
+    p->trigram = trigram;
+    hash_insert(&postings, &p->elem);
+  }
+  if (p->id_cnt == p->id_cap) {
+    size_t cap = p->id_cap ? 2 * p->id_cap : 4;
+    uint32_t *ids = realloc(p->ids, cap * sizeof *ids);
+    if (ids == NULL)
+      return false;
+    p->ids = ids;
+    p->id_cap = cap;
+  }
+  p->ids[p->id_cnt++] = id;
+  posting_total++;
+  return true;
+}
+
+/* Stops covering file F.  Its ids in postings become stale. */
+static void file_remove(struct indexed_file *f) {
+  hash_delete(&indexed_files, &f->elem);
+  indexed_file_free(&f->elem, NULL);
+}
+
+/* Adds a record for the file at SECTOR with ID, which is always
+   searched if ALL.  Returns the record, or a null pointer if out of
+   memory. */
+static struct indexed_file *file_insert(block_sector_t sector, uint32_t id,
+                                        bool all) {
+  struct indexed_file *f = malloc(sizeof *f);
+  if (f == NULL)
+    return NULL;
+  f->sector = sector;
+  f->id = id;
+  f->all = all;
+  hash_insert(&indexed_files, &f->elem);
+  return f;
+}
+
+/* Notes that the index in memory differs from the one on disk,
+   marking the one on disk as out of date on the first change. */
+static void mark_changed(void) {
+  if (!changed) {
+    struct content_index_header h = {CONTENT_INDEX_MAGIC, CONTENT_INDEX_OPEN,
+                                     0, 0};
+    inode_write_at(index_inode, &h, sizeof h, 0);
+    changed = true;
+  }
+}
+
+/* Sets up the tables of an empty index. */
+static void tables_init(void) {
+  if (!hash_init(&indexed_files, indexed_file_hash, indexed_file_less, NULL) ||
+      !hash_init(&postings, posting_hash, posting_less, NULL))
+    PANIC("can't allocate content index");
+  next_id = 0;
+  posting_total = 0;
+  changed = false;
+}
+
+/* Frees the tables of the index. */
+static void tables_done(void) {
+  hash_destroy(&indexed_files, indexed_file_free);
+  hash_destroy(&postings, posting_free);
+}
+
+/* Reads the POSTING_CNT postings at P, before END, into memory.
+   Returns false if they are damaged or out of memory. */
+static bool postings_load(const uint8_t *p, const uint8_t *end,
+                          uint32_t posting_cnt) {
+  uint32_t trigram = 0;
+
+  for (uint32_t i = 0; i < posting_cnt; i++) {
+    struct posting *list;
+    uint32_t gap, cnt, id = 0;
+
+    if (!get_varint(&p, end, &gap) || !get_varint(&p, end, &cnt) ||
+        cnt == 0 || cnt > (size_t)(end - p))
+      return false;
+    trigram += gap;
+    list = calloc(1, sizeof *list);
+    if (list == NULL ||
+        (list->ids = malloc(cnt * sizeof *list->ids)) == NULL) {
+      free(list);
+      return false;
+    }
+    list->trigram = trigram;
+    list->id_cap = cnt;
+    hash_insert(&postings, &list->elem);
+    for (uint32_t j = 0; j < cnt; j++) {
+      if (!get_varint(&p, end, &gap) || gap >= next_id - id)
+        return false;
+      id += gap;
+      list->ids[list->id_cnt++] = id;
+    }
+    posting_total += cnt;
+  }
+  return true;
+}
+
+/* Loads the index from INDEX_INODE.  Leaves it empty if the copy on
+   disk was not written back cleanly. */
+static void index_load(void) {
+  offset_t length = inode_length(index_inode);
+  struct content_index_header h;
+  const struct content_index_record *records;
+  uint8_t *buf;
+
+  if (length < (offset_t)sizeof h ||
+      inode_read_at(index_inode, &h, sizeof h, 0) != sizeof h ||
+      h.magic != CONTENT_INDEX_MAGIC || h.state != CONTENT_INDEX_CLEAN ||
+      (size_t)(length - sizeof h) / sizeof *records < h.file_cnt) {
+    mark_changed();
+    return;
+  }
+
+  buf = malloc(length);
+  if (buf == NULL || inode_read_at(index_inode, buf, length, 0) != length) {
+    free(buf);
+    mark_changed();
+    return;
+  }
+  records = (const struct content_index_record *)(buf + sizeof h);
+  for (next_id = 0; next_id < h.file_cnt; next_id++)
+    if (file_insert(records[next_id].sector, next_id,
+                    records[next_id].all) == NULL)
+      break;
+  if (next_id < h.file_cnt ||
+      !postings_load((const uint8_t *)(records + h.file_cnt), buf + length,
+                     h.posting_cnt)) {
+    tables_done();
+    tables_init();
+    mark_changed();
+  }
+  free(buf);
+}
+
+/* Writes the index back to INDEX_INODE if it has changed, leaving
+   out stale ids and renumbering the others from 0.  Returns false if
+   out of memory or disk space. */
+static bool index_save(void) {
+  struct content_index_header h = {CONTENT_INDEX_MAGIC, CONTENT_INDEX_CLEAN,
+                                   hash_size(&indexed_files), 0};
+  size_t list_cnt = hash_size(&postings);
+  struct indexed_file **files;
+  struct posting **lists;
+  uint32_t *new_ids, trigram = 0;
+  struct hash_iterator it;
+  uint8_t *buf, *p;
+  size_t length, i;
+  bool success = false;
+
+  if (!changed)
+    return true;
+  /* A varint takes at most 5 bytes. */
+  length = sizeof h + h.file_cnt * sizeof(struct content_index_record) +
+           list_cnt * 10 + posting_total * 5;
+  files = malloc(h.file_cnt * sizeof *files + 1);
+  lists = malloc(list_cnt * sizeof *lists + 1);
+  new_ids = malloc(next_id * sizeof *new_ids + 1);
+  buf = malloc(length);
+  if (files == NULL || lists == NULL || new_ids == NULL || buf == NULL)
+    goto done;
+
+  /* Files in id order, numbered from 0. */
+  i = 0;
+  hash_first(&it, &indexed_files);
+  while (hash_next(&it))
+    files[i++] = hash_entry(hash_cur(&it), struct indexed_file, elem);
+  qsort(files, h.file_cnt, sizeof *files, compare_file_ids);
+  memset(new_ids, 0xff, next_id * sizeof *new_ids);
+  p = buf + sizeof h;
+  for (i = 0; i < h.file_cnt; i++) {
+    struct content_index_record r = {files[i]->sector, files[i]->all};
+    memcpy(p, &r, sizeof r);
+    p += sizeof r;
+    new_ids[files[i]->id] = i;
+  }
+
+  /* Postings in trigram order, without stale ids. */
+  i = 0;
+  hash_first(&it, &postings);
+  while (hash_next(&it))
+    lists[i++] = hash_entry(hash_cur(&it), struct posting, elem);
+  qsort(lists, list_cnt, sizeof *lists, compare_posting_trigrams);
+  for (i = 0; i < list_cnt; i++) {
+    uint32_t cnt = 0, prev = 0;
+
+    for (size_t j = 0; j < lists[i]->id_cnt; j++)
+      cnt += new_ids[lists[i]->ids[j]] != UINT32_MAX;
+    if (cnt == 0)
+      continue;
+    p = put_varint(p, lists[i]->trigram - trigram);
+    p = put_varint(p, cnt);
+    for (size_t j = 0; j < lists[i]->id_cnt; j++) {
+      uint32_t id = new_ids[lists[i]->ids[j]];
+      if (id != UINT32_MAX) {
+        p = put_varint(p, id - prev);
+        prev = id;
+      }
+    }
+    trigram = lists[i]->trigram;
+    h.posting_cnt++;
+  }
+  memcpy(buf, &h, sizeof h);
+
+  success = inode_rewrite(index_inode, buf, p - buf);
+  if (success)
+    changed = false;
+done:
+  free(files);
+  free(lists);
+  free(new_ids);
+  free(buf);
+  return success;
+}
+
+/* Opens the content index of the file system, if it has one. */
+void content_index_open(void) {
+  struct free_map_extra extra;
+
+  free_map_get_extra(&extra);
+  if (extra.content_index == 0)
+    return;
+  index_inode = inode_open(extra.content_index);
+  if (index_inode == NULL)
+    return;
+  tables_init();
+  index_load();
+}
+
+/* Writes the content index back to disk, if there is one, and
+   closes it. */
+void content_index_close(void) {
+  if (index_inode == NULL)
+    return;
+  if (!index_save())
+    printf("Warning: could not write the content index.\n");
+  inode_close(index_inode);
+  index_inode = NULL;
+  tables_done();
+}
+
+/* Returns true if the file system has a content index. */
+bool content_index_exists(void) { return index_inode != NULL; }
+
+/* Gives the file system an empty content index, unless it already
+   has one.  Returns false if out of disk space. */
+bool content_index_create(void) {
+  struct free_map_extra extra;
+  block_sector_t sector;
+
+  if (index_inode != NULL)
+    return true;
+  if (!free_map_allocate(1, &sector))
+    return false;
+  if (!inode_create(sector, 0, false)) {
+    free_map_release(sector, 1);
+    return false;
+  }
+  index_inode = inode_open(sector);
+  if (index_inode == NULL) {
+    /* The empty inode is inline, so its sector is all it owns. */
+    free_map_release(sector, 1);
+    return false;
+  }
+  inode_set_internal(index_inode);
+  tables_init();
+
+  free_map_get_extra(&extra);
+  extra.content_index = sector;
+  if (!free_map_put_extra(&extra)) {
+    content_index_drop();
+    return false;
+  }
+  mark_changed();
+  return true;
+}
+
+/* Removes the content index of the file system, if it has one. */
+void content_index_drop(void) {
+  struct free_map_extra extra;
+
+  if (index_inode == NULL)
+    return;
+  free_map_get_extra(&extra);
+  extra.content_index = 0;
+  free_map_put_extra(&extra);
+  inode_remove(index_inode);
+  inode_close(index_inode);
+  index_inode = NULL;
+  tables_done();
+}
+
+/* Returns true if the content index covers the file at SECTOR, so
+   that there is no need to index it. */
+bool content_index_covers(block_sector_t sector) {
+  return index_inode == NULL || file_find(sector) != NULL;
+}
+
+/* Records that the file at SECTOR contains the trigrams in SET,
+   which must have been fed the whole file, and empties SET. */
+void content_index_add(block_sector_t sector, struct trigram_set *set) {
+  bool all = trigram_set_is_noise(set);
+  struct indexed_file *f;
+
+  if (index_inode != NULL) {
+    f = file_find(sector);
+    if (f != NULL)
+      file_remove(f);
+    f = file_insert(sector, next_id++, all);
+    for (size_t i = 0; f != NULL && !all && i < set->cnt; i++)
+      if (!posting_append(set->trigrams[i], f->id)) {
+        file_remove(f);
+        f = NULL;
+      }
+    mark_changed();
+  }
+  trigram_set_clear(set);
+}
+
+/* Stops covering the file at SECTOR, whose contents have changed. */
+void content_index_changed(block_sector_t sector) {
+  struct indexed_file *f;
+
+  if (index_inode != NULL && (f = file_find(sector)) != NULL) {
+    file_remove(f);
+    mark_changed();
+  }
+}
+
+/* Stops covering the file at SECTOR, which has been removed. */
+void content_index_removed(block_sector_t sector) {
+  content_index_changed(sector);
+}
+
+/* Returns the increasing ids of the files that contain every
+   trigram of PATTERN, storing their number into *CNT, or a null
+   pointer if PATTERN is too short to have trigrams. */
+static uint32_t *pattern_files(const char *pattern, size_t *cnt) {
+  size_t len = strlen(pattern);
+  struct posting **lists;
+  uint32_t *ids;
+  size_t list_cnt = 0, i, j;
+
+  *cnt = 0;
+  if (len < 3)
+    return NULL;
+  lists = malloc((len - 2) * sizeof *lists);
+  ids = malloc(sizeof *ids);
+  if (lists == NULL || ids == NULL) {
+    free(lists);
+    free(ids);
+    return NULL;
+  }
+
+  for (i = 0; i + 2 < len; i++) {
+    const uint8_t *p = (const uint8_t *)pattern + i;
+    struct posting *list = posting_find(p[0] << 16 | p[1] << 8 | p[2]);
+    if (list == NULL) {
+      free(lists);
+      return ids;
+    }
+    lists[list_cnt++] = list;
+  }
+
+  /* Start from the shortest list and keep the ids every other list
+     has as well. */
+  for (i = 1; i < list_cnt; i++)
+    if (lists[i]->id_cnt < lists[0]->id_cnt) {
+      struct posting *tmp = lists[0];
+      lists[0] = lists[i];
+      lists[i] = tmp;
+    }
+  free(ids);
+  ids = malloc((lists[0]->id_cnt + 1) * sizeof *ids);
+  if (ids == NULL) {
+    free(lists);
+    return NULL;
+  }
+  for (i = 0; i < lists[0]->id_cnt; i++) {
+    uint32_t id = lists[0]->ids[i];
+    for (j = 1; j < list_cnt; j++)
+      if (!sorted_contains(lists[j]->ids, lists[j]->id_cnt, id))
+        break;
+    if (j == list_cnt)
+      ids[(*cnt)++] = id;
+  }
+  free(lists);
+  return ids;
+}
+
+/* Looks up the CNT PATTERNS in the content index.  Returns a null
+   pointer, which matches every file, if there is no index or out of
+   memory. */
+struct content_query *content_index_query(char **patterns, size_t cnt) {
+  struct content_query *q;
+
+  if (index_inode == NULL)
+    return NULL;
+  q = malloc(sizeof *q);
+  if (q == NULL)
+    return NULL;
+  q->cnt = cnt;
+  q->ids = calloc(cnt, sizeof *q->ids);
+  q->id_cnt = calloc(cnt, sizeof *q->id_cnt);
+  if (q->ids == NULL || q->id_cnt == NULL) {
+    content_query_free(q);
+    return NULL;
+  }
+  for (size_t i = 0; i < cnt; i++)
+    q->ids[i] = pattern_files(patterns[i], &q->id_cnt[i]);
+  return q;
+}
+
+/* Returns true if the file at SECTOR may contain one of the patterns
+   of Q, so that it must be searched. */
+bool content_query_may_match(const struct content_query *q,
+                             block_sector_t sector) {
+  struct indexed_file *f;
+
+  if (q == NULL || index_inode == NULL)
+    return true;
+  f = file_find(sector);
+  if (f == NULL || f->all)
+    return true;
+  for (size_t i = 0; i < q->cnt; i++)
+    if (q->ids[i] == NULL || sorted_contains(q->ids[i], q->id_cnt[i], f->id))
+      return true;
+  return false;
+}
+
+/* Frees Q. */
+void content_query_free(struct content_query *q) {
+  if (q == NULL)
+    return;
+  if (q->ids != NULL)
+    for (size_t i = 0; i < q->cnt; i++)
+      free(q->ids[i]);
+  free(q->ids);
+  free(q->id_cnt);
+  free(q);
+}
+
+/* Prints statistics about the content index. */
+void content_index_print_stats(void) {
+  struct hash_iterator it;
+  size_t all_cnt = 0;
+
+  if (index_inode == NULL) {
+    printf("Content index: none\n");
+    return;
+  }
+  hash_first(&it, &indexed_files);
+  while (hash_next(&it))
+    all_cnt += hash_entry(hash_cur(&it), struct indexed_file, elem)->all;
+  printf("Content index: %zu files (%zu always searched), %zu trigrams, "
+         "%zu postings, %" PROTd " bytes on disk\n",
+         hash_size(&indexed_files), all_cnt, hash_size(&postings),
+         posting_total, inode_length(index_inode));
+}
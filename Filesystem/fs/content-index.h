@@ -0,0 +1,40 @@
+#ifndef FILESYS_CONTENT_INDEX_H
+#define FILESYS_CONTENT_INDEX_H
+
+#include "block.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The distinct trigrams of a file, collected as it is read. */
+struct trigram_set;
+
+struct trigram_set *trigram_set_create(void);
+void trigram_set_destroy(struct trigram_set *);
+void trigram_set_feed(struct trigram_set *, const void *, size_t);
+
+/* Files that may contain any of a list of patterns. */
+struct content_query;
+
+/* Loading and saving. */
+void content_index_open(void);
+void content_index_close(void);
+
+/* Creating and removing the index. */
+bool content_index_exists(void);
+bool content_index_create(void);
+void content_index_drop(void);
+
+/* Keeping it up to date. */
+bool content_index_covers(block_sector_t);
+void content_index_add(block_sector_t, struct trigram_set *);
+void content_index_changed(block_sector_t);
+void content_index_removed(block_sector_t);
+
+/* Searching. */
+struct content_query *content_index_query(char **patterns, size_t cnt);
+bool content_query_may_match(const struct content_query *, block_sector_t);
+void content_query_free(struct content_query *);
+
+void content_index_print_stats(void);
+
+#endif /* fs/content-index.h */
@@ -1,15 +1,364 @@
 #include "directory.h"
+#include "content-index.h"
 #include "debug.h"
 #include "filesys.h"
+#include "free-map.h"
+#include "hash.h"
 #include "inode.h"
 #include "list.h"
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 struct dir *cwd;
 
+/* Directory header.
+
+   The otherwise unused name bytes of a directory's parent entry
+   hold a header that keeps a directory's bookkeeping next to its
+   entries: a count of the entries in use, a hint for where to look
+   for a free slot, and the location of its hash index.
+   Directories written before the header existed have zeros there.
+   Their header is worked out by one scan when it is needed and
+   written the first time they are changed, so that only reading a
+   directory never writes to it.
+
+   A directory starts out small and grows one entry at a time as
+   files are added.  Once fewer than a quarter of the slots of a
+   directory with more than DIR_COMPACT_MIN slots are in use, its
+   entries are packed together and the file is shrunk.
+
+   A directory with more than DIR_LINEAR_MAX slots also keeps a hash
+   index of its names in a separate, hidden inode: an open
+   addressing table of 32-bit slot numbers, probed linearly from
+   hash_string(name).  Slot 0 is the parent entry and is never
+   indexed, so 0 marks an empty bucket.  The entries stay in the
+   linear format, which remains the source of truth, so the index
+   can be rebuilt from them at any time.  Only dir_add() and
+   dir_remove() build an index; lookups search a directory without
+   one linearly.  A binary without this code may have changed a
+   directory behind its index, so an index is checked against the
+   entries before it is first trusted, and dropped if it does not
+   match. */
+#define DIR_HEADER_MAGIC 0x52444844 /* "DHDR" */
+#define DIR_LINEAR_MAX 32           /* Larger directories are indexed. */
+#define DIR_COMPACT_MIN 64          /* Smaller directories are not packed. */
+#define DIR_INDEX_MIN_BUCKETS 64    /* Fits inline in the index inode. */
+#define DIR_INDEX_DELETED UINT32_MAX
+
+struct dir_header {
+  uint32_t magic;        /* DIR_HEADER_MAGIC. */
+  uint32_t entry_cnt;    /* Entries in use, not counting the parent. */
+  uint32_t free_slot;    /* Every slot below this one is in use. */
+  block_sector_t index;  /* Inode of the hash index, 0 if none. */
+  uint32_t bucket_cnt;   /* Buckets in the index, a power of 2. */
+  uint32_t used_cnt;     /* Buckets naming a slot. */
+  uint32_t deleted_cnt;  /* Buckets marked DIR_INDEX_DELETED. */
+};
+
+_Static_assert(sizeof(struct dir_header) <= NAME_MAX + 1,
+               "directory header must fit in a name");
+
+/* Returns the number of slots of DIR, including the parent entry. */
+static size_t slot_count(struct inode *dir) {
+  return inode_length(dir) / sizeof(struct dir_entry);
+}
+
+/* Writes header H into PARENT, DIR's parent entry, and to DIR. */
+static void header_put(struct inode *dir, struct dir_entry *parent,
+                       const struct dir_header *h) {
+  memcpy(parent->name, h, sizeof *h);
+  inode_write_at(dir, parent, sizeof *parent, 0);
+}
+
+/* Reads DIR's parent entry into *PARENT and its header into *H.
+   Returns false if DIR cannot be read or has no header yet. */
+static bool header_read(struct inode *dir, struct dir_entry *parent,
+                        struct dir_header *h) {
+  if (inode_read_at(dir, parent, sizeof *parent, 0) != sizeof *parent)
+    return false;
+  memcpy(h, parent->name, sizeof *h);
+  return h->magic == DIR_HEADER_MAGIC;
+}
+
+/* Reads DIR's parent entry into *PARENT and its header into *H,
+   working the header out by a scan of DIR if it has none.  A header
+   made that way reaches the disk only when the caller writes H
+   back.  Returns false if DIR cannot be read. */
+static bool header_get(struct inode *dir, struct dir_entry *parent,
+                       struct dir_header *h) {
+  struct dir_entry e;
+  offset_t ofs;
+
+  if (header_read(dir, parent, h))
+    return true;
+  if (inode_read_at(dir, parent, sizeof *parent, 0) != sizeof *parent)
+    return false;
+
+  memset(h, 0, sizeof *h);
+  h->magic = DIR_HEADER_MAGIC;
+  for (ofs = sizeof e; inode_read_at(dir, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e) {
+    if (e.in_use)
+      h->entry_cnt++;
+    else if (h->free_slot == 0)
+      h->free_slot = ofs / sizeof e;
+  }
+  if (h->free_slot == 0)
+    h->free_slot = ofs / sizeof e;
+  return true;
+}
+
+static uint32_t bucket_read(struct inode *index, uint32_t b) {
+  uint32_t slot = 0;
+  inode_read_at(index, &slot, sizeof slot, b * sizeof slot);
+  return slot;
+}
+
+static void bucket_write(struct inode *index, uint32_t b, uint32_t slot) {
+  inode_write_at(index, &slot, sizeof slot, b * sizeof slot);
+}
+
+/* Frees the index of the directory with header H, if it has one,
+   leaving the directory to be searched linearly until the next
+   index_build().  The caller must write H back. */
+static void index_drop(struct dir_header *h) {
+  if (h->index != 0) {
+    struct inode *index = inode_open(h->index);
+    if (index != NULL) {
+      inode_remove(index);
+      inode_close(index);
+    }
+  }
+  h->index = 0;
+  h->bucket_cnt = h->used_cnt = h->deleted_cnt = 0;
+}
+
+/* Builds a fresh index for DIR, whose header is H, from its
+   entries, replacing any existing one.  The table is sized for four
+   times the names in use so that it can double before it needs
+   rebuilding.  Returns false, leaving DIR unindexed, if out of
+   memory or disk space.  The caller must write H back. */
+static bool index_build(struct inode *dir, struct dir_header *h) {
+  size_t slot_cnt = slot_count(dir);
+  struct dir_entry *entries = malloc(slot_cnt * sizeof *entries);
+  uint32_t *buckets = NULL;
+  uint32_t bucket_cnt = DIR_INDEX_MIN_BUCKETS;
+  uint32_t used_cnt = 0;
+  block_sector_t sector;
+  struct inode *index;
+  size_t slot;
+
+  index_drop(h);
+  if (entries == NULL ||
+      inode_read_at(dir, entries, slot_cnt * sizeof *entries, 0) !=
+          (offset_t)(slot_cnt * sizeof *entries))
+    goto fail;
+  for (slot = 1; slot < slot_cnt; slot++)
+    used_cnt += entries[slot].in_use;
+  while (bucket_cnt < 4 * used_cnt)
+    bucket_cnt *= 2;
+
+  buckets = calloc(bucket_cnt, sizeof *buckets);
+  if (buckets == NULL)
+    goto fail;
+  for (slot = 1; slot < slot_cnt; slot++)
+    if (entries[slot].in_use) {
+      uint32_t b = hash_string(entries[slot].name) & (bucket_cnt - 1);
+      while (buckets[b] != 0)
+        b = (b + 1) & (bucket_cnt - 1);
+      buckets[b] = slot;
+    }
+
+  if (!free_map_allocate_near(1, inode_get_inumber(dir), &sector))
+    goto fail;
+  if (!inode_create(sector, bucket_cnt * sizeof *buckets, false)) {
+    free_map_release(sector, 1);
+    goto fail;
+  }
+  index = inode_open(sector);
+  if (index == NULL)
+    goto fail;
+  inode_set_internal(index);
+  inode_write_at(index, buckets, bucket_cnt * sizeof *buckets, 0);
+  inode_close(index);
+
+  h->index = sector;
+  h->bucket_cnt = bucket_cnt;
+  h->used_cnt = used_cnt;
+  h->deleted_cnt = 0;
+  inode_set_checked_index(dir, sector);
+  free(buckets);
+  free(entries);
+  return true;
+
+fail:
+  free(buckets);
+  free(entries);
+  return false;
+}
+
+/* Gives DIR, whose header is H, an index if it is large enough to
+   want one and has none.  Only called on paths that change DIR.  The
+   caller must write H back. */
+static void index_want(struct inode *dir, struct dir_header *h) {
+  if (h->index == 0 && slot_count(dir) > DIR_LINEAR_MAX)
+    index_build(dir, h);
+}
+
+/* Returns true if DIR, whose header is H and parent entry PARENT,
+   has an index that can be trusted.
+
+   An index is checked against the entries once each time DIR is
+   read in: every bucket must name a slot in use, and every entry
+   in use must be found by probing from its name.  If it fails the
+   check or cannot be read, the index is dropped and H written back,
+   leaving DIR to be searched linearly until it is next changed. */
+static bool index_check(struct inode *dir, struct dir_entry *parent,
+                        struct dir_header *h) {
+  size_t slot_cnt = slot_count(dir);
+  struct dir_entry *entries = NULL;
+  uint32_t *buckets = NULL;
+  uint32_t mask = h->bucket_cnt - 1;
+  uint32_t used = 0, deleted = 0, b, probes;
+  struct inode *index;
+  size_t slot, in_use = 0;
+  bool ok = false;
+
+  if (h->index == 0)
+    return false;
+  if (inode_checked_index(dir) == h->index)
+    return true;
+
+  index = inode_open(h->index);
+  if (index == NULL || h->bucket_cnt == 0 || (h->bucket_cnt & mask) != 0)
+    goto done;
+  entries = malloc(slot_cnt * sizeof *entries);
+  buckets = malloc(h->bucket_cnt * sizeof *buckets);
+  if (entries == NULL || buckets == NULL ||
+      inode_read_at(dir, entries, slot_cnt * sizeof *entries, 0) !=
+          (offset_t)(slot_cnt * sizeof *entries) ||
+      inode_read_at(index, buckets, h->bucket_cnt * sizeof *buckets, 0) !=
+          (offset_t)(h->bucket_cnt * sizeof *buckets))
+    goto done;
+
+  for (b = 0; b < h->bucket_cnt; b++)
+    if (buckets[b] == DIR_INDEX_DELETED)
+      deleted++;
+    else if (buckets[b] != 0) {
+      if (buckets[b] >= slot_cnt || !entries[buckets[b]].in_use)
+        goto done;
+      used++;
+    }
+  for (slot = 1; slot < slot_cnt; slot++)
+    if (entries[slot].in_use) {
+      in_use++;
+      b = hash_string(entries[slot].name) & mask;
+      for (probes = 0; buckets[b] != slot; probes++, b = (b + 1) & mask)
+        if (buckets[b] == 0 || probes == h->bucket_cnt)
+          goto done;
+    }
+  ok = used == in_use && used == h->used_cnt && deleted == h->deleted_cnt;
+
+done:
+  inode_close(index);
+  free(entries);
+  free(buckets);
+  if (ok)
+    inode_set_checked_index(dir, h->index);
+  else {
+    index_drop(h);
+    header_put(dir, parent, h);
+  }
+  return ok;
+}
+
+/* Records in the index of the directory with header H, if it has
+   one, that NAME is in SLOT.  Rebuilds the index instead once it is
+   half full.  The caller must write H back. */
+static void index_insert(struct inode *dir, struct dir_header *h,
+                         const char *name, uint32_t slot) {
+  struct inode *index;
+  uint32_t mask, b;
+
+  if (h->index == 0)
+    return;
+  if (2 * (h->used_cnt + h->deleted_cnt + 1) > h->bucket_cnt) {
+    /* The new entry is already written, so the rebuild sees it. */
+    index_build(dir, h);
+    return;
+  }
+
+  index = inode_open(h->index);
+  if (index == NULL) {
+    index_drop(h);
+    return;
+  }
+  mask = h->bucket_cnt - 1;
+  for (b = hash_string(name) & mask;; b = (b + 1) & mask) {
+    uint32_t s = bucket_read(index, b);
+    if (s == 0)
+      break;
+    if (s == DIR_INDEX_DELETED) {
+      h->deleted_cnt--;
+      break;
+    }
+  }
+  bucket_write(index, b, slot);
+  inode_close(index);
+  h->used_cnt++;
+}
+
+/* Marks bucket B of the index of the directory with header H
+   deleted.  The caller must write H back. */
+static void index_delete(struct dir_header *h, uint32_t b) {
+  struct inode *index = inode_open(h->index);
+
+  if (index == NULL) {
+    index_drop(h);
+    return;
+  }
+  bucket_write(index, b, DIR_INDEX_DELETED);
+  inode_close(index);
+  h->used_cnt--;
+  h->deleted_cnt++;
+}
+
+/* Packs the entries of DIR, whose header is H, into the lowest
+   slots and shrinks DIR to fit them.  The index is dropped, to be
+   rebuilt by the caller if DIR is still large.  Open
+   directories reading DIR with dir_readdir() may skip or repeat
+   entries.  The caller must write H back, which PARENT is updated
+   for. */
+static void dir_compact(struct inode *dir, struct dir_entry *parent,
+                        struct dir_header *h) {
+  size_t slot_cnt = slot_count(dir);
+  struct dir_entry *entries = malloc(slot_cnt * sizeof *entries);
+  size_t slot, used = 1;
+
+  if (entries == NULL ||
+      inode_read_at(dir, entries, slot_cnt * sizeof *entries, 0) !=
+          (offset_t)(slot_cnt * sizeof *entries)) {
+    free(entries);
+    return;
+  }
+  for (slot = 1; slot < slot_cnt; slot++)
+    if (entries[slot].in_use)
+      entries[used++] = entries[slot];
+
+  index_drop(h);
+  h->entry_cnt = used - 1;
+  h->free_slot = used;
+  memcpy(parent->name, h, sizeof *h);
+  entries[0] = *parent;
+  if (!inode_rewrite(dir, entries, used * sizeof *entries))
+    h->free_slot = 1; /* Still correct, if slow, for the unpacked slots. */
+  free(entries);
+}
+
 /*
  * Split path.
  * directory and filename should be preallocated buffers.
@@ -47,6 +396,161 @@ void split_path_filename(const char *path, char *directory, char *filename) {
   free(s);
 }
 
+/* Directory entry cache.
+
+   Maps a directory's inode sector and a name to the inode sector
+   the name refers to, or records that the name does not exist,
+   so that resolving a recently resolved path reads no directory
+   data.  dir_add() and dir_remove() keep it coherent.  Past
+   DCACHE_SIZE entries the least recently used one is evicted. */
+#define DCACHE_SIZE 512
+
+struct dentry {
+  struct hash_elem elem;     /* Element in dcache. */
+  struct list_elem lru_elem; /* Element in dcache_lru, newest first. */
+  block_sector_t parent;     /* Sector of the directory's inode. */
+  block_sector_t sector;     /* Sector of the named inode. */
+  bool negative;             /* True if NAME does not exist. */
+  char name[NAME_MAX + 1];
+};
+
+static struct hash dcache;
+static struct list dcache_lru;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long dcache_hits, dcache_negative_hits, dcache_misses;
+
+static unsigned dentry_hash(const struct hash_elem *e, void *aux UNUSED) {
+  const struct dentry *d = hash_entry(e, struct dentry, elem);
+  return hash_string(d->name) ^ hash_int(d->parent);
+}
+
+static bool dentry_less(const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED) {
+  const struct dentry *x = hash_entry(a, struct dentry, elem);
+  const struct dentry *y = hash_entry(b, struct dentry, elem);
+  if (x->parent != y->parent)
+    return x->parent < y->parent;
+  return strcmp(x->name, y->name) < 0;
+}
+
+static void dentry_free(struct hash_elem *e, void *aux UNUSED) {
+  free(hash_entry(e, struct dentry, elem));
+}
+
+/* Initializes the directory entry cache. */
+void dir_cache_init(void) {
+  hash_init(&dcache, dentry_hash, dentry_less, NULL);
+  llist_init(&dcache_lru);
+  dcache_hits = dcache_negative_hits = dcache_misses = 0;
+}
+
+/* Empties the directory entry cache and frees its memory. */
+void dir_cache_done(void) {
+  pthread_mutex_lock(&dcache_lock);
+  hash_destroy(&dcache, dentry_free);
+  llist_init(&dcache_lru);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Prints the size and hit rate of the directory entry cache. */
+void dir_cache_print_stats(void) {
+  pthread_mutex_lock(&dcache_lock);
+  printf("dentry cache: %zu/%d entries, %llu hits (%llu negative), "
+         "%llu misses\n",
+         hash_size(&dcache), DCACHE_SIZE, dcache_hits + dcache_negative_hits,
+         dcache_negative_hits, dcache_misses);
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Returns the cached entry for NAME in directory PARENT, or a null
+   pointer.  The caller must hold dcache_lock. */
+static struct dentry *dcache_find(block_sector_t parent, const char *name) {
+  struct dentry key;
+  struct hash_elem *e;
+
+  key.parent = parent;
+  strncpy(key.name, name, sizeof key.name);
+  e = hash_find(&dcache, &key.elem);
+  return e != NULL ? hash_entry(e, struct dentry, elem) : NULL;
+}
+
+/* Looks NAME up in the cache for directory PARENT.  On a hit,
+   returns true and sets *FOUND and, if found, *SECTOR. */
+static bool dcache_lookup(block_sector_t parent, const char *name,
+                          bool *found, block_sector_t *sector) {
+  struct dentry *d;
+
+  pthread_mutex_lock(&dcache_lock);
+  d = dcache_find(parent, name);
+  if (d == NULL) {
+    dcache_misses++;
+  } else {
+    list_remove(&d->lru_elem);
+    list_push_front(&dcache_lru, &d->lru_elem);
+    if (d->negative)
+      dcache_negative_hits++;
+    else
+      dcache_hits++;
+    *found = !d->negative;
+    *sector = d->sector;
+  }
+  pthread_mutex_unlock(&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in directory PARENT refers to the inode in
+   SECTOR if FOUND, or does not exist if not. */
+static void dcache_insert(block_sector_t parent, const char *name, bool found,
+                          block_sector_t sector) {
+  struct dentry *d;
+
+  pthread_mutex_lock(&dcache_lock);
+  d = dcache_find(parent, name);
+  if (d != NULL) {
+    list_remove(&d->lru_elem);
+  } else {
+    d = malloc(sizeof *d);
+    if (d == NULL)
+      goto done;
+    d->parent = parent;
+    strncpy(d->name, name, sizeof d->name);
+    hash_insert(&dcache, &d->elem);
+  }
+  d->negative = !found;
+  d->sector = sector;
+  list_push_front(&dcache_lru, &d->lru_elem);
+
+  /* Evict after inserting, not before: the other order takes the
+     table across a bucket count boundary and back each time. */
+  if (hash_size(&dcache) > DCACHE_SIZE) {
+    d = list_entry(list_pop_back(&dcache_lru), struct dentry, lru_elem);
+    hash_delete(&dcache, &d->elem);
+    free(d);
+  }
+
+done:
+  pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Drops every cached entry of directory PARENT, which is being
+   removed, so that a directory later created in the same sector
+   does not inherit them. */
+static void dcache_forget_dir(block_sector_t parent) {
+  struct list_elem *e, *next;
+
+  pthread_mutex_lock(&dcache_lock);
+  for (e = list_begin(&dcache_lru); e != list_end(&dcache_lru); e = next) {
+    struct dentry *d = list_entry(e, struct dentry, lru_elem);
+    next = list_next(e);
+    if (d->parent == parent) {
+      list_remove(&d->lru_elem);
+      hash_delete(&dcache, &d->elem);
+      free(d);
+    }
+  }
+  pthread_mutex_unlock(&dcache_lock);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create(block_sector_t sector, size_t entry_cnt) {
@@ -62,9 +566,17 @@ bool dir_create(block_sector_t sector, size_t entry_cnt) {
   ASSERT(dir != NULL);
   struct dir_entry e;
 
+  struct dir_header h;
+
   memset(&e, 0, sizeof(struct dir_entry));
   e.inode_sector = sector;
   e.in_use = true;
+  memset(&h, 0, sizeof h);
+  h.magic = DIR_HEADER_MAGIC;
+  h.free_slot = 1;
+  if (entry_cnt > DIR_LINEAR_MAX)
+    index_build(dir->inode, &h);
+  memcpy(e.name, &h, sizeof h);
 
   if (inode_write_at(dir->inode, &e, sizeof e, 0) != sizeof e) {
     success = false;
@@ -175,15 +687,64 @@ struct inode *dir_get_inode(struct dir *dir) {
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   A directory whose index passes index_check() is searched through
+   it, and *BP is set to the index bucket naming the entry if BP is
+   non-null.  Others are searched linearly, which also covers an
+   index that can no longer be read. */
 static bool lookup(const struct dir *dir, const char *name,
-                   struct dir_entry *ep, offset_t *ofsp) {
-  struct dir_entry e;
+                   struct dir_entry *ep, offset_t *ofsp, uint32_t *bp) {
+  struct dir_entry e, parent;
+  struct dir_header h;
+  bool has_header;
   size_t ofs;
 
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
 
+  has_header = header_read(dir->inode, &parent, &h);
+  if (has_header && h.entry_cnt == 0)
+    return false;
+
+  if (has_header && index_check(dir->inode, &parent, &h)) {
+    struct inode *index = inode_open(h.index);
+    uint32_t mask = h.bucket_cnt - 1;
+    uint32_t b = hash_string(name) & mask;
+    uint32_t probes;
+    bool found = false;
+
+    if (index == NULL) {
+      /* Search linearly below, without the index. */
+      index_drop(&h);
+      header_put(dir->inode, &parent, &h);
+      goto linear;
+    }
+    for (probes = 0; probes < h.bucket_cnt; probes++, b = (b + 1) & mask) {
+      uint32_t slot = bucket_read(index, b);
+      if (slot == 0)
+        break;
+      if (slot == DIR_INDEX_DELETED)
+        continue;
+      ofs = slot * sizeof e;
+      if (inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e &&
+          e.in_use && !strcmp(name, e.name)) {
+        found = true;
+        break;
+      }
+    }
+    inode_close(index);
+    if (!found)
+      return false;
+    if (ep != NULL)
+      *ep = e;
+    if (ofsp != NULL)
+      *ofsp = ofs;
+    if (bp != NULL)
+      *bp = b;
+    return true;
+  }
+
+linear:
   for (ofs = sizeof e; /* 0-pos is for parent directory */
        inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
@@ -199,16 +760,10 @@ static bool lookup(const struct dir *dir, const char *name,
 
 /* Returns whether the DIR is empty. */
 bool dir_is_empty(const struct dir *dir) {
-  struct dir_entry e;
-  offset_t ofs;
+  struct dir_entry parent;
+  struct dir_header h;
 
-  for (ofs = sizeof e; /* 0-pos is for parent directory */
-       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-    if (e.in_use)
-      return false;
-  }
-  return true;
+  return header_get(dir->inode, &parent, &h) && h.entry_cnt == 0;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -228,11 +783,21 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
     // parent directory : the information is stored at the first (0-pos) entry.
     inode_read_at(dir->inode, &e, sizeof e, 0);
     *inode = inode_open(e.inode_sector);
-  } else if (lookup(dir, name, &e, NULL)) {
-    // normal lookup. lookuped entry is stored into e
-    *inode = inode_open(e.inode_sector);
-  } else
+  } else if (strlen(name) > NAME_MAX) {
     *inode = NULL;
+  } else {
+    // normal lookup, answered from the dentry cache when possible
+    block_sector_t parent = inode_get_inumber(dir->inode);
+    block_sector_t sector = 0;
+    bool found;
+    if (!dcache_lookup(parent, name, &found, &sector)) {
+      found = lookup(dir, name, &e, NULL, NULL);
+      if (found)
+        sector = e.inode_sector;
+      dcache_insert(parent, name, found, sector);
+    }
+    *inode = found ? inode_open(sector) : NULL;
+  }
 
   return *inode != NULL;
 }
@@ -259,16 +824,19 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
     return false;
   }
   /* Check that NAME is not in use. */
-  if (lookup(dir, name, NULL, NULL)) {
+  if (lookup(dir, name, NULL, NULL, NULL)) {
     goto done;
   }
 
   // update the child directory [inode_sector] has a parent directory [dir]
   if (is_dir) {
-    /* e is a parent-directory-entry here */
+    /* e is a parent-directory-entry here; keep the child's header */
     struct dir *child_dir = dir_open(inode_open(inode_sector));
     if (child_dir == NULL)
       goto done;
+    if (inode_read_at(child_dir->inode, &e, sizeof e, 0) != sizeof e)
+      memset(&e, 0, sizeof e);
+    e.in_use = true;
     e.inode_sector = inode_get_inumber(dir_get_inode(dir));
     if (inode_write_at(child_dir->inode, &e, sizeof e, 0) != sizeof e) {
       dir_close(child_dir);
@@ -276,24 +844,40 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
     }
     dir_close(child_dir);
   }
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
+  /* Set OFS to offset of a free slot, looking from the header's
+     hint onwards.  If there are no free slots, it is set to the
+     current end-of-file, growing the directory by one entry.
 
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+  struct dir_entry parent;
+  struct dir_header h;
+  if (!header_get(dir->inode, &parent, &h))
+    goto done;
+  ofs = (offset_t)h.free_slot * sizeof e;
+  if (h.entry_cnt + 1 >= slot_count(dir->inode))
+    ofs = inode_length(dir->inode);
+  for (; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) {
     if (!e.in_use)
       break;
   }
 
   /* Write slot. */
+  memset(&e, 0, sizeof e);
   e.in_use = true;
   strncpy(e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success) {
+    h.entry_cnt++;
+    h.free_slot = ofs / sizeof e + 1;
+    index_insert(dir->inode, &h, name, ofs / sizeof e);
+    index_want(dir->inode, &h);
+    header_put(dir->inode, &parent, &h);
+    dcache_insert(inode_get_inumber(dir->inode), name, true, inode_sector);
+  }
 
 done:
   return success;
@@ -307,12 +891,13 @@ bool dir_remove(struct dir *dir, const char *name) {
   struct inode *inode = NULL;
   bool success = false;
   offset_t ofs;
+  uint32_t bucket = UINT32_MAX;
 
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
 
   /* Find directory entry. */
-  if (!lookup(dir, name, &e, &ofs)) {
+  if (!lookup(dir, name, &e, &ofs, &bucket)) {
     goto done;
   }
   /* Open inode. */
@@ -324,8 +909,17 @@ bool dir_remove(struct dir *dir, const char *name) {
   /* Prevent removing non-empty directory. */
   if (inode_is_directory(inode)) {
     // target : the directory to be removed. (dir : the base directory)
-    struct dir *target = dir_open(inode);
-    bool is_empty = dir_is_empty(target);
+    struct dir *target = dir_open(inode_reopen(inode));
+    bool is_empty = target != NULL && dir_is_empty(target);
+    if (is_empty) {
+      /* The index would otherwise outlive its directory. */
+      struct dir_entry parent;
+      struct dir_header h;
+      if (header_get(inode, &parent, &h) && h.index != 0) {
+        index_drop(&h);
+        header_put(inode, &parent, &h);
+      }
+    }
     dir_close(target);
     if (!is_empty)
       goto done; // can't delete
@@ -336,6 +930,25 @@ bool dir_remove(struct dir *dir, const char *name) {
   if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e) {
     goto done;
   }
+  struct dir_entry parent;
+  struct dir_header h;
+  if (header_get(dir->inode, &parent, &h)) {
+    if (bucket != UINT32_MAX && h.index != 0)
+      index_delete(&h, bucket);
+    h.entry_cnt--;
+    if (ofs / sizeof e < h.free_slot)
+      h.free_slot = ofs / sizeof e;
+    if (slot_count(dir->inode) > DIR_COMPACT_MIN &&
+        4 * (h.entry_cnt + 1) < slot_count(dir->inode))
+      dir_compact(dir->inode, &parent, &h);
+    index_want(dir->inode, &h);
+    header_put(dir->inode, &parent, &h);
+  }
+  dcache_insert(inode_get_inumber(dir->inode), name, false, 0);
+  if (inode_is_directory(inode))
+    dcache_forget_dir(e.inode_sector);
+  else
+    content_index_removed(e.inode_sector);
   /* Remove inode. */
   inode_remove(inode);
   success = true;
@@ -372,4 +985,42 @@ block_sector_t dir_readdir_inode(struct dir *dir, char name[NAME_MAX + 1]) {
     }
   }
   return -1;
-}
\ No newline at end of file
+}
+
+/* Directory entries read by each inode_read_at() of
+   dir_readdir_bulk(). */
+#define DIR_READ_BATCH 64
+
+/* Reads up to CNT of the next entries of DIR into RECORDS, along
+   with the length and type of each file, reading the directory a
+   batch of entries at a time and without opening the files.
+   Returns the number of records filled in, which is 0 once DIR has
+   no more entries. */
+size_t dir_readdir_bulk(struct dir *dir, struct dir_record *records,
+                        size_t cnt) {
+  struct dir_entry batch[DIR_READ_BATCH];
+  size_t filled = 0;
+
+  while (filled < cnt) {
+    offset_t bytes = inode_read_at(dir->inode, batch, sizeof batch, dir->pos);
+    size_t n = bytes / sizeof *batch;
+    size_t i;
+
+    if (n == 0)
+      break;
+    for (i = 0; i < n && filled < cnt; i++) {
+      struct dir_record *r = &records[filled];
+      dir->pos += sizeof *batch;
+      if (!batch[i].in_use)
+        continue;
+      r->inode_sector = batch[i].inode_sector;
+      strncpy(r->name, batch[i].name, NAME_MAX + 1);
+      if (!inode_stat(r->inode_sector, &r->length, &r->is_dir)) {
+        r->length = 0;
+        r->is_dir = false;
+      }
+      filled++;
+    }
+  }
+  return filled;
+}
@@ -25,11 +25,25 @@ struct dir_entry {
   bool in_use;                 /* In use or free? */
 };
 
+/* A directory entry with the length and type of its file, as
+   returned by dir_readdir_bulk(). */
+struct dir_record {
+  block_sector_t inode_sector; /* Sector number of header. */
+  offset_t length;             /* File size in bytes. */
+  bool is_dir;                 /* Directory or file? */
+  char name[NAME_MAX + 1];     /* Null terminated file name. */
+};
+
 extern struct dir *cwd;
 
 /* Directory and Path manipulation utilities. */
 void split_path_filename(const char *path, char *directory, char *filename);
 
+/* Directory entry cache. */
+void dir_cache_init(void);
+void dir_cache_done(void);
+void dir_cache_print_stats(void);
+
 /* Opening and closing directories. */
 bool dir_create(block_sector_t sector, size_t entry_cnt);
 struct dir *dir_open(struct inode *);
@@ -46,5 +60,6 @@ bool dir_add(struct dir *, const char *name, block_sector_t, bool is_dir);
 bool dir_remove(struct dir *, const char *name);
 bool dir_readdir(struct dir *, char name[NAME_MAX + 1]);
 block_sector_t dir_readdir_inode(struct dir *, char name[NAME_MAX + 1]);
+size_t dir_readdir_bulk(struct dir *, struct dir_record *, size_t cnt);
 
 #endif /* fs/directory.h */
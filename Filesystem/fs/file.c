@@ -1,69 +1,77 @@
 #include "file.h"
+#include "content-index.h"
 #include "debug.h"
+#include "hash.h"
 #include "inode.h"
-#include "list.h"
 #include "string.h"
 #include <stdbool.h>
 #include <stdlib.h>
 
-struct list file_table;
+/* Files opened by name through fsutil, keyed by name. */
+struct hash file_table;
 struct file_table_entry {
   char *fname;           /* file descriptor. */
   struct file *f;        /* pointer to open file. */
-  struct list_elem elem; /* used by the process to store its open files. */
+  struct hash_elem elem; /* element in file_table. */
 };
 
-void init_file_table() { llist_init(&file_table); }
+static unsigned file_table_hash(const struct hash_elem *e, void *aux UNUSED) {
+  return hash_string(hash_entry(e, struct file_table_entry, elem)->fname);
+}
 
-void free_file_table() {
-  while (!list_empty(&file_table)) {
-    struct list_elem *e = list_pop_front(&file_table);
-    struct file_table_entry *entry =
-        list_entry(e, struct file_table_entry, elem);
-    free(entry->fname);
-    file_close(entry->f);
-    list_remove(&entry->elem);
-    free(entry);
-  }
+static bool file_table_less(const struct hash_elem *a,
+                            const struct hash_elem *b, void *aux UNUSED) {
+  return strcmp(hash_entry(a, struct file_table_entry, elem)->fname,
+                hash_entry(b, struct file_table_entry, elem)->fname) < 0;
 }
 
-void add_to_file_table(struct file *file, char *fname) {
-  if (get_file_by_fname(fname) != NULL)
-    return;
+static void file_table_free(struct hash_elem *e, void *aux UNUSED) {
+  struct file_table_entry *entry = hash_entry(e, struct file_table_entry, elem);
+  free(entry->fname);
+  file_close(entry->f);
+  free(entry);
+}
+
+/* Returns the file table entry for FNAME, or a null pointer. */
+static struct file_table_entry *file_table_find(char *fname) {
+  struct file_table_entry key;
+  struct hash_elem *e;
+
+  key.fname = fname;
+  e = hash_find(&file_table, &key.elem);
+  return e != NULL ? hash_entry(e, struct file_table_entry, elem) : NULL;
+}
+
+void init_file_table() {
+  hash_init(&file_table, file_table_hash, file_table_less, NULL);
+}
+
+void free_file_table() { hash_destroy(&file_table, file_table_free); }
 
+void add_to_file_table(struct file *file, char *fname) {
   struct file_table_entry *entry = malloc(sizeof(struct file_table_entry));
   entry->fname = strdup(fname);
   entry->f = file;
-  list_push_back(&file_table, &entry->elem);
+  if (hash_insert(&file_table, &entry->elem) != NULL) {
+    /* already there */
+    free(entry->fname);
+    free(entry);
+  }
 }
 
 bool remove_from_file_table(char *fname) {
-  struct list_elem *e = list_begin(&file_table);
-  struct file_table_entry *entry;
-  for (; e != list_end(&file_table); e = list_next(e)) {
-    entry = list_entry(e, struct file_table_entry, elem);
-    if (strcmp(entry->fname, fname) == 0) {
-      free(entry->fname);
-      file_close(entry->f);
-      list_remove(&entry->elem);
-      free(entry);
-      return true;
-    }
-  }
-  return false;
+  struct file_table_entry *entry = file_table_find(fname);
+  if (entry == NULL)
+    return false;
+  hash_delete(&file_table, &entry->elem);
+  file_table_free(&entry->elem, NULL);
+  return true;
 }
 
 /* return file object crossponding to given filename */
 struct file *get_file_by_fname(char *fname) {
-  struct list_elem *e = list_begin(&file_table);
-  struct file_table_entry *entry;
-  for (; e != list_end(&file_table); e = list_next(e)) {
-    entry = list_entry(e, struct file_table_entry, elem);
-    if (strcmp(entry->fname, fname) == 0)
-      return entry->f;
-  }
-
-  return NULL;
+  struct file_table_entry *entry = file_table_find(fname);
+  return entry != NULL ? entry->f : NULL;
 }
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -132,6 +140,7 @@ offset_t file_read_at(struct file *file, void *buffer, offset_t size,
    Sets the final character of the buffer to the null terminator. */
 offset_t file_write(struct file *file, const void *buffer, offset_t size) {
   ((char *)buffer)[size - 1] = '\0';
+  content_index_changed(inode_get_inumber(file->inode));
   offset_t bytes_written = inode_write_at(file->inode, buffer, size, file->pos);
   file->pos += bytes_written - 2;
   return bytes_written;
@@ -146,9 +155,19 @@ offset_t file_write(struct file *file, const void *buffer, offset_t size) {
    The file's current position is unaffected. */
 offset_t file_write_at(struct file *file, const void *buffer, offset_t size,
                        offset_t file_ofs) {
+  content_index_changed(inode_get_inumber(file->inode));
   return inode_write_at(file->inode, buffer, size, file_ofs);
 }
 
+/* Extends FILE to SIZE bytes, reserving its new data sectors as one
+   contiguous run where possible.  Returns true if successful, false
+   if writes are denied or the disk is full.
+   The file's current position is unaffected. */
+bool file_allocate(struct file *file, offset_t size) {
+  ASSERT(file != NULL);
+  return inode_fallocate(file->inode, size);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void file_deny_write(struct file *file) {
@@ -5,7 +5,7 @@
 #include <stdbool.h>
 
 struct inode;
-extern struct list file_table;
+extern struct hash file_table;
 
 /* An open file. */
 struct file {
@@ -32,6 +32,7 @@ offset_t file_read_at(struct file *, void *, offset_t size, offset_t start);
 offset_t file_write(struct file *, const void *, offset_t);
 offset_t file_write_at(struct file *, const void *, offset_t size,
                        offset_t start);
+bool file_allocate(struct file *, offset_t size);
 
 /* Preventing writes. */
 void file_deny_write(struct file *);
@@ -1,5 +1,6 @@
 #include "filesys.h"
 #include "cache.h"
+#include "content-index.h"
 #include "debug.h"
 #include "directory.h"
 #include "file.h"
@@ -8,7 +9,9 @@
 #include <stdio.h>
 #include <string.h>
 
-#define MAX_FILES_IN_DIRECTORY 1000
+/* Entries the root directory starts out with: as many as fit in its
+   inode sector.  Directories grow as files are added to them. */
+#define ROOT_DIR_ENTRIES (INODE_INLINE_SIZE / sizeof(struct dir_entry))
 
 /* Partition that contains the file system. */
 struct block *fs_device;
@@ -25,11 +28,13 @@ void filesys_init(bool format) {
   inode_init();
   free_map_init();
   buffer_cache_init();
+  dir_cache_init();
 
   if (format)
     do_format();
 
   free_map_open();
+  content_index_open();
 
   printf("Num free sectors: %d\n", num_free_sectors());
 
@@ -39,8 +44,11 @@ void filesys_init(bool format) {
 /* Shuts down the file system module, writing any unwritten data
    to disk. */
 void filesys_done(void) {
+  content_index_close();
+  inode_reclaim_wait();
   free_map_close();
   buffer_cache_close();
+  dir_cache_done();
   free_file_table();
 }
 
@@ -64,13 +72,25 @@ bool filesys_create(const char *path, offset_t initial_size, bool is_dir) {
   // printf("1");
   if (dir != NULL) {
     // printf("2");
-    if (free_map_allocate(1, &inode_sector)) {
+    // files follow their directory's previous file, directories go to
+    // the block group with the most room
+    struct inode *dir_inode = dir_get_inode(dir);
+    block_sector_t hint =
+        is_dir ? free_map_group_hint() : inode_alloc_hint(dir_inode);
+    if (free_map_allocate_near(1, hint, &inode_sector)) {
+      inode_set_alloc_hint(dir_inode, inode_sector);
       // printf("3");
       if (inode_create(inode_sector, initial_size, is_dir)) {
         // printf("4");
         if (dir_add(dir, file_name, inode_sector, is_dir)) {
           // printf("5");
           success = true;
+        } else {
+          // free the data sectors too, not just the inode sector
+          struct inode *inode = inode_open(inode_sector);
+          inode_remove(inode);
+          inode_close(inode);
+          inode_sector = 0;
         }
       }
     }
@@ -155,7 +175,7 @@ bool filesys_chdir(const char *name) {
 static void do_format(void) {
   printf("Formatting file system...");
   free_map_create();
-  if (!dir_create(ROOT_DIR_SECTOR, MAX_FILES_IN_DIRECTORY))
+  if (!dir_create(ROOT_DIR_SECTOR, ROOT_DIR_ENTRIES))
     PANIC("root directory creation failed");
   free_map_close();
   printf("done.\n");
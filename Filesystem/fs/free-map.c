@@ -3,12 +3,349 @@
 #include "debug.h"
 #include "file.h"
 #include "filesys.h"
+#include "hash.h"
 #include "inode.h"
+#include "list.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static struct file *free_map_file; /* Free map file. */
 struct bitmap *free_map;           /* Free map, one bit per sector. */
 
+/* Guards the free map and everything below, which the background
+   reclaimer in inode.c updates as well. */
+static pthread_mutex_t free_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t free_cnt;     /* Sectors free in the bitmap. */
+static size_t deferred_cnt; /* Sectors waiting for the reclaimer. */
+
+/* Bits of the free map changed since it was last written out, as the
+   half-open range [dirty_start, dirty_end).  Empty if dirty_start >=
+   dirty_end. */
+static size_t dirty_start = SIZE_MAX;
+static size_t dirty_end = 0;
+
+/* Records that CNT bits starting at SECTOR differ from the free map
+   file. */
+static void mark_dirty(block_sector_t sector, size_t cnt) {
+  if (sector < dirty_start)
+    dirty_start = sector;
+  if (sector + cnt > dirty_end)
+    dirty_end = sector + cnt;
+}
+
+/* A run of free sectors. */
+struct extent {
+  struct hash_elem elem;        /* Element in extents_by_start. */
+  struct list_elem bucket_elem; /* Element in its size bucket. */
+  block_sector_t start;         /* First free sector. */
+  block_sector_t length;        /* Number of free sectors, at least 1. */
+};
+
+/* Free extent index: every run of free sectors in the free map,
+   fully coalesced, so that no two extents touch.  Kept in step with
+   the bitmap by the functions below and rebuilt from it whenever the
+   bitmap is loaded.
+
+   Extents are found by their first sector through a hash table.  The
+   extent that holds a given sector, or that ends right before it, is
+   found by asking the bitmap where the run of free sectors around it
+   starts, which its summary tree answers in O(log n).  So taking and
+   giving back sectors cost O(log n), however many extents there
+   are. */
+static struct hash extents_by_start;
+static size_t extent_cnt;
+
+/* Size buckets of the free extent index, for best fit and for the
+   largest extent.  An extent shorter than EXACT_LENGTHS sectors goes
+   in the bucket for its exact length.  Longer ones share a bucket per
+   quarter of a power of 2, so that the lengths in such a bucket
+   differ by less than a quarter. */
+#define EXACT_LENGTHS 64
+#define EXACT_BITS 6 /* log2(EXACT_LENGTHS). */
+#define BUCKET_CNT                                                             \
+  (EXACT_LENGTHS + (sizeof(block_sector_t) * CHAR_BIT - EXACT_BITS) * 4)
+static struct list buckets[BUCKET_CNT];
+
+/* Next-fit cursor: plain free_map_allocate() calls continue from
+   where the previous allocation ended. */
+static block_sector_t cursor;
+
+/* Returns the bucket of an extent of LENGTH sectors. */
+static size_t bucket_of(block_sector_t length) {
+  int log;
+
+  ASSERT(length > 0);
+  if (length < EXACT_LENGTHS)
+    return length;
+  log = sizeof(block_sector_t) * CHAR_BIT - 1 - __builtin_clz(length);
+  return EXACT_LENGTHS + (log - EXACT_BITS) * 4 + ((length >> (log - 2)) & 3);
+}
+
+/* Returns the shortest length that goes in bucket B. */
+static size_t bucket_min(size_t b) {
+  if (b < EXACT_LENGTHS)
+    return b;
+  b -= EXACT_LENGTHS;
+  return (size_t)(4 + b % 4) << (b / 4 + EXACT_BITS - 2);
+}
+
+/* Returns the first bucket whose extents all hold at least CNT
+   sectors, or BUCKET_CNT if there is none. */
+static size_t bucket_fitting(size_t cnt) {
+  size_t b = bucket_of(cnt);
+  return bucket_min(b) == cnt ? b : b + 1;
+}
+
+static unsigned extent_hash(const struct hash_elem *e, void *aux UNUSED) {
+  return hash_int(hash_entry(e, struct extent, elem)->start);
+}
+
+static bool extent_less(const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED) {
+  return hash_entry(a, struct extent, elem)->start <
+         hash_entry(b, struct extent, elem)->start;
+}
+
+/* Returns the extent that starts at SECTOR, or a null pointer. */
+static struct extent *extent_at(block_sector_t sector) {
+  struct extent key;
+  struct hash_elem *e;
+
+  key.start = sector;
+  e = hash_find(&extents_by_start, &key.elem);
+  return e != NULL ? hash_entry(e, struct extent, elem) : NULL;
+}
+
+/* Returns the extent whose sectors end right before END, which the
+   free map must show as free up to END, or a null pointer if sector
+   END - 1 is in use. */
+static struct extent *extent_ending(block_sector_t end) {
+  size_t start = bitmap_run_start(free_map, end, false);
+  return start < end ? extent_at(start) : NULL;
+}
+
+/* Returns the first extent in a bucket from B on, or a null pointer if
+   they are all empty. */
+static struct extent *bucket_first(size_t b) {
+  for (; b < BUCKET_CNT; b++)
+    if (!list_empty(&buckets[b]))
+      return list_entry(list_front(&buckets[b]), struct extent, bucket_elem);
+  return NULL;
+}
+
+/* Returns true if some extent may be at least CNT sectors long, and
+   false if none can be. */
+static bool may_fit(size_t cnt) {
+  if (cnt == 0 || cnt > UINT32_MAX)
+    return false;
+  return bucket_first(bucket_of(cnt)) != NULL;
+}
+
+/* Makes extent X cover LENGTH sectors starting at START. */
+static void extent_set(struct extent *x, block_sector_t start,
+                       block_sector_t length) {
+  if (x->start != start) {
+    hash_delete(&extents_by_start, &x->elem);
+    x->start = start;
+    hash_insert(&extents_by_start, &x->elem);
+  }
+  if (bucket_of(x->length) != bucket_of(length)) {
+    list_remove(&x->bucket_elem);
+    list_push_front(&buckets[bucket_of(length)], &x->bucket_elem);
+  }
+  x->length = length;
+}
+
+/* Adds an extent of LENGTH sectors starting at START. */
+static void extent_insert(block_sector_t start, block_sector_t length) {
+  struct extent *x = malloc(sizeof *x);
+  if (x == NULL)
+    PANIC("free extent index: out of memory");
+  x->start = start;
+  x->length = length;
+  hash_insert(&extents_by_start, &x->elem);
+  list_push_front(&buckets[bucket_of(length)], &x->bucket_elem);
+  extent_cnt++;
+}
+
+/* Deletes extent X. */
+static void extent_remove(struct extent *x) {
+  hash_delete(&extents_by_start, &x->elem);
+  list_remove(&x->bucket_elem);
+  free(x);
+  extent_cnt--;
+}
+
+/* Removes the CNT free sectors starting at SECTOR, which must lie in
+   a single extent, from the index. */
+static void index_take(block_sector_t sector, size_t cnt) {
+  struct extent *x = extent_ending(sector + 1);
+  ASSERT(x != NULL);
+
+  block_sector_t start = x->start;
+  block_sector_t end = start + x->length;
+  ASSERT(sector + cnt <= end);
+
+  if (start < sector && sector + cnt < end) {
+    extent_set(x, start, sector - start);
+    extent_insert(sector + cnt, end - (sector + cnt));
+  } else if (start < sector)
+    extent_set(x, start, sector - start);
+  else if (sector + cnt < end)
+    extent_set(x, sector + cnt, end - (sector + cnt));
+  else
+    extent_remove(x);
+}
+
+/* Adds the CNT sectors starting at SECTOR, which the free map must
+   already show as free, to the index, merging them with the extents
+   they touch. */
+static void index_give(block_sector_t sector, size_t cnt) {
+  struct extent *prev = extent_ending(sector);
+  struct extent *next = extent_at(sector + cnt);
+
+  if (prev != NULL && next != NULL) {
+    block_sector_t length = prev->length + cnt + next->length;
+    extent_remove(next);
+    extent_set(prev, prev->start, length);
+  } else if (prev != NULL)
+    extent_set(prev, prev->start, prev->length + cnt);
+  else if (next != NULL)
+    extent_set(next, sector, next->length + cnt);
+  else
+    extent_insert(sector, cnt);
+}
+
+static void extent_free(struct hash_elem *e, void *aux UNUSED) {
+  free(hash_entry(e, struct extent, elem));
+}
+
+/* Rebuilds the free extent index from the free map. */
+static void index_build(void) {
+  size_t size = bitmap_size(free_map);
+  size_t start = 0, b;
+
+  if (extents_by_start.buckets != NULL)
+    hash_clear(&extents_by_start, extent_free);
+  else if (!hash_init(&extents_by_start, extent_hash, extent_less, NULL))
+    PANIC("free extent index: out of memory");
+  for (b = 0; b < BUCKET_CNT; b++)
+    llist_init(&buckets[b]);
+  extent_cnt = 0;
+  free_cnt = 0;
+  while (start < size &&
+         (start = bitmap_scan(free_map, start, 1, false)) != BITMAP_ERROR) {
+    size_t end = bitmap_scan(free_map, start, 1, true);
+    if (end == BITMAP_ERROR)
+      end = size;
+    extent_insert(start, end - start);
+    free_cnt += end - start;
+    start = end;
+  }
+  cursor = 0;
+}
+
+/* Marks the CNT sectors starting at SECTOR, all free, as in use. */
+static void take(block_sector_t sector, size_t cnt) {
+  index_take(sector, cnt);
+  bitmap_set_multiple(free_map, sector, cnt, true);
+  mark_dirty(sector, cnt);
+  free_cnt -= cnt;
+  cursor = sector + cnt < bitmap_size(free_map) ? sector + cnt : 0;
+}
+
+/* Marks the CNT sectors starting at SECTOR, all in use, as free. */
+static void give(block_sector_t sector, size_t cnt) {
+  ASSERT(bitmap_all(free_map, sector, cnt));
+  bitmap_set_multiple(free_map, sector, cnt, false);
+  index_give(sector, cnt);
+  mark_dirty(sector, cnt);
+  free_cnt += cnt;
+}
+
+/* Takes the first run of CNT free sectors at or after HINT, wrapping
+   around, and stores it in *SECTORP. */
+static bool allocate_near(size_t cnt, block_sector_t hint,
+                          block_sector_t *sectorp) {
+  size_t sector = BITMAP_ERROR;
+
+  if (!may_fit(cnt))
+    return false;
+
+  // the bitmap's summary tree finds the run without walking extents
+  if (hint < bitmap_size(free_map))
+    sector = bitmap_scan(free_map, hint, cnt, false);
+  if (sector == BITMAP_ERROR)
+    sector = bitmap_scan(free_map, 0, cnt, false);
+  if (sector == BITMAP_ERROR)
+    return false;
+  take(sector, cnt);
+  *sectorp = sector;
+  return true;
+}
+
+/* Takes CNT sectors from the start of a small free extent that holds
+   them and stores the first in *SECTORP.
+
+   The extent comes from the first nonempty bucket whose extents all
+   hold CNT sectors, so it is the smallest that fits when CNT is below
+   EXACT_LENGTHS, and otherwise less than a quarter longer than the
+   smallest in that bucket.  That costs O(BUCKET_CNT).  Only when no
+   such bucket has an extent does the search walk CNT's own bucket,
+   whose extents may be shorter than CNT. */
+static bool allocate_best(size_t cnt, block_sector_t *sectorp) {
+  struct extent *best;
+  struct list_elem *e;
+
+  if (cnt == 0 || cnt > UINT32_MAX)
+    return false;
+
+  best = bucket_first(bucket_fitting(cnt));
+  if (best == NULL)
+    for (e = list_begin(&buckets[bucket_of(cnt)]);
+         e != list_end(&buckets[bucket_of(cnt)]); e = list_next(e)) {
+      struct extent *x = list_entry(e, struct extent, bucket_elem);
+      if (x->length >= cnt && (best == NULL || x->length < best->length))
+        best = x;
+    }
+  if (best == NULL)
+    return false;
+  *sectorp = best->start;
+  take(*sectorp, cnt);
+  return true;
+}
+
+/* Takes CNT sectors near HINT, or else the whole of one of the
+   largest extents, and stores the first in *SECTORP.  Returns the
+   number taken.
+
+   The extent taken is the first in the highest nonempty bucket, so
+   it is less than a quarter shorter than the largest extent. */
+static size_t allocate_upto(size_t cnt, block_sector_t hint,
+                            block_sector_t *sectorp) {
+  struct extent *largest = NULL;
+  size_t b;
+
+  if (cnt == 0 || extent_cnt == 0)
+    return 0;
+  if (allocate_near(cnt, hint, sectorp))
+    return cnt;
+
+  for (b = BUCKET_CNT; largest == NULL && b-- > 0;)
+    if (!list_empty(&buckets[b]))
+      largest = list_entry(list_front(&buckets[b]), struct extent,
+                           bucket_elem);
+  cnt = largest->length;
+  *sectorp = largest->start;
+  take(*sectorp, cnt);
+  return cnt;
+}
+
 /* Initializes the free map. */
 void free_map_init(void) {
   free_map = bitmap_create(block_size(fs_device) - 1);
@@ -17,34 +354,227 @@ void free_map_init(void) {
     PANIC("bitmap creation failed--file system device is too large");
   bitmap_mark(free_map, FREE_MAP_SECTOR);
   bitmap_mark(free_map, ROOT_DIR_SECTOR);
+  index_build();
 }
 
+/* Returns the number of free sectors, counting those of removed
+   files that the background reclaimer has yet to free. */
 int num_free_sectors(void) {
-  return bitmap_count(free_map, 0, bitmap_size(free_map), 0);
+  pthread_mutex_lock(&free_map_lock);
+  size_t cnt = free_cnt + deferred_cnt;
+  pthread_mutex_unlock(&free_map_lock);
+  return cnt;
+}
+
+/* Returns the number of sectors that can be allocated right now. */
+size_t free_map_available(void) {
+  pthread_mutex_lock(&free_map_lock);
+  size_t cnt = free_cnt;
+  pthread_mutex_unlock(&free_map_lock);
+  return cnt;
+}
+
+/* Returns true if SECTOR is in use. */
+bool free_map_in_use(block_sector_t sector) {
+  pthread_mutex_lock(&free_map_lock);
+  bool in_use = bitmap_test(free_map, sector);
+  pthread_mutex_unlock(&free_map_lock);
+  return in_use;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP, searching onward from where the previous
+   allocation ended (next fit).
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available, even after waiting for the background
+   reclaimer to finish.
+   The change reaches the free map file at the next free_map_flush(). */
 bool free_map_allocate(size_t cnt, block_sector_t *sectorp) {
-  block_sector_t sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR && free_map_file != NULL &&
-      !bitmap_write(free_map, free_map_file)) {
-    bitmap_set_multiple(free_map, sector, cnt, false);
-    sector = BITMAP_ERROR;
+  return free_map_allocate_near(cnt, cursor, sectorp);
+}
+
+/* Like free_map_allocate(), but takes the first run of CNT free
+   sectors at or after HINT, wrapping around to the start of the disk
+   if there is none. */
+bool free_map_allocate_near(size_t cnt, block_sector_t hint,
+                            block_sector_t *sectorp) {
+  bool success, retry;
+  pthread_mutex_lock(&free_map_lock);
+  success = allocate_near(cnt, hint, sectorp);
+  retry = !success && deferred_cnt > 0;
+  pthread_mutex_unlock(&free_map_lock);
+
+  if (retry) {
+    inode_reclaim_wait();
+    pthread_mutex_lock(&free_map_lock);
+    success = allocate_near(cnt, hint, sectorp);
+    pthread_mutex_unlock(&free_map_lock);
+  }
+  return success;
+}
+
+/* Like free_map_allocate(), but takes CNT sectors from the start of
+   the smallest free extent that holds them (best fit), so that large
+   extents stay whole for large requests. */
+bool free_map_allocate_best(size_t cnt, block_sector_t *sectorp) {
+  bool success, retry;
+  pthread_mutex_lock(&free_map_lock);
+  success = allocate_best(cnt, sectorp);
+  retry = !success && deferred_cnt > 0;
+  pthread_mutex_unlock(&free_map_lock);
+
+  if (retry) {
+    inode_reclaim_wait();
+    pthread_mutex_lock(&free_map_lock);
+    success = allocate_best(cnt, sectorp);
+    pthread_mutex_unlock(&free_map_lock);
+  }
+  return success;
+}
+
+/* Allocates between 1 and CNT consecutive sectors and stores the
+   first into *SECTORP: CNT sectors at or after HINT if such a run
+   exists (see free_map_allocate_near()), otherwise the whole of the
+   largest free extent.  Returns the number of sectors allocated, or
+   0 if the disk is full. */
+size_t free_map_allocate_upto(size_t cnt, block_sector_t hint,
+                              block_sector_t *sectorp) {
+  size_t got;
+  bool retry;
+  pthread_mutex_lock(&free_map_lock);
+  got = allocate_upto(cnt, hint, sectorp);
+  retry = got < cnt && deferred_cnt > 0;
+  pthread_mutex_unlock(&free_map_lock);
+
+  if (retry) {
+    // a longer run may be on its way back; try again once it is
+    if (got > 0)
+      free_map_release(*sectorp, got);
+    inode_reclaim_wait();
+    pthread_mutex_lock(&free_map_lock);
+    got = allocate_upto(cnt, hint, sectorp);
+    pthread_mutex_unlock(&free_map_lock);
   }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  return got;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Returns the first sector of the block group with the most free
+   sectors.  New directories are placed there, so that each directory
+   and the files created next to it have room to grow together. */
+block_sector_t free_map_group_hint(void) {
+  size_t size = bitmap_size(free_map);
+  size_t best = 0, best_free = 0;
+  size_t group;
+
+  pthread_mutex_lock(&free_map_lock);
+  for (group = 0; group < size; group += FREE_MAP_GROUP_SECTORS) {
+    size_t cnt = size - group < FREE_MAP_GROUP_SECTORS
+                     ? size - group
+                     : FREE_MAP_GROUP_SECTORS;
+    size_t group_free = bitmap_count(free_map, group, cnt, false);
+    if (group_free > best_free) {
+      best = group;
+      best_free = group_free;
+    }
+  }
+  pthread_mutex_unlock(&free_map_lock);
+  return best;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.
+   The change reaches the free map file at the next free_map_flush(). */
 void free_map_release(block_sector_t sector, size_t cnt) {
-  ASSERT(bitmap_all(free_map, sector, cnt));
-  bitmap_set_multiple(free_map, sector, cnt, false);
-  bitmap_write(free_map, free_map_file);
+  pthread_mutex_lock(&free_map_lock);
+  give(sector, cnt);
+  pthread_mutex_unlock(&free_map_lock);
+}
+
+/* Counts CNT sectors that are still in use as free already, because
+   the background reclaimer will free them. */
+void free_map_defer(size_t cnt) {
+  pthread_mutex_lock(&free_map_lock);
+  deferred_cnt += cnt;
+  pthread_mutex_unlock(&free_map_lock);
+}
+
+/* Releases CNT sectors starting at SECTOR that were counted by
+   free_map_defer(), and stops counting them separately.  Then
+   forgets about EXCESS further deferred sectors, which the estimate
+   passed to free_map_defer() overcounted. */
+void free_map_release_deferred(block_sector_t sector, size_t cnt,
+                               size_t excess) {
+  pthread_mutex_lock(&free_map_lock);
+  if (cnt > 0)
+    give(sector, cnt);
+  cnt += excess;
+  deferred_cnt -= cnt < deferred_cnt ? cnt : deferred_cnt;
+  pthread_mutex_unlock(&free_map_lock);
+}
+
+/* Marks CNT sectors starting at SECTOR as in use, whatever their
+   current state. */
+void free_map_mark(block_sector_t sector, size_t cnt) {
+  size_t end = sector + cnt;
+  size_t start = sector;
+
+  pthread_mutex_lock(&free_map_lock);
+  while (start < end &&
+         (start = bitmap_scan(free_map, start, 1, false)) < end) {
+    size_t run_end = bitmap_scan(free_map, start, 1, true);
+    if (run_end > end)
+      run_end = end;
+    index_take(start, run_end - start);
+    free_cnt -= run_end - start;
+    start = run_end;
+  }
+  bitmap_set_multiple(free_map, sector, cnt, true);
+  mark_dirty(sector, cnt);
+  pthread_mutex_unlock(&free_map_lock);
+}
+
+/* Writes the free map sectors changed since the last flush to the
+   free map file.  Returns true if successful, false otherwise.
+
+   Callers flush after allocating and before returning an inode that
+   refers to the new sectors, so the free map file never shows a
+   sector in use by an inode as free.  Releases may lag until the
+   next flush; that can only leak sectors, not hand them out twice. */
+bool free_map_flush(void) {
+  bool success = true;
+
+  pthread_mutex_lock(&free_map_lock);
+  if (free_map_file != NULL && dirty_start < dirty_end) {
+    success = bitmap_write_range(free_map, free_map_file, dirty_start,
+                                 dirty_end - dirty_start);
+    if (success) {
+      dirty_start = SIZE_MAX;
+      dirty_end = 0;
+    }
+  }
+  pthread_mutex_unlock(&free_map_lock);
+  return success;
+}
+
+/* Reads the file system wide data that follows the bitmap in the
+   free map file into *EXTRA, or zeros if there is none. */
+void free_map_get_extra(struct free_map_extra *extra) {
+  offset_t ofs = bitmap_file_size(free_map);
+
+  if (free_map_file == NULL ||
+      file_read_at(free_map_file, extra, sizeof *extra, ofs) != sizeof *extra ||
+      extra->magic != FREE_MAP_EXTRA_MAGIC)
+    memset(extra, 0, sizeof *extra);
+}
+
+/* Writes EXTRA after the bitmap in the free map file.  Returns true
+   if successful, false otherwise. */
+bool free_map_put_extra(const struct free_map_extra *extra) {
+  struct free_map_extra copy = *extra;
+  offset_t ofs = bitmap_file_size(free_map);
+
+  copy.magic = FREE_MAP_EXTRA_MAGIC;
+  return free_map_file != NULL &&
+         file_write_at(free_map_file, &copy, sizeof copy, ofs) == sizeof copy;
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -54,10 +584,16 @@ void free_map_open(void) {
     PANIC("can't open free map");
   if (!bitmap_read(free_map, free_map_file))
     PANIC("can't read free map");
+  index_build();
 }
 
 /* Writes the free map to disk and closes the free map file. */
-void free_map_close(void) { file_close(free_map_file); }
+void free_map_close(void) {
+  if (!free_map_flush())
+    PANIC("can't write free map");
+  file_close(free_map_file);
+  free_map_file = NULL;
+}
 
 /* Creates a new free map file on disk and writes the free map to
    it. */
@@ -74,4 +610,6 @@ void free_map_create(void) {
     PANIC("can't open free map");
   if (!bitmap_write(free_map, free_map_file))
     PANIC("can't write free map");
+  dirty_start = SIZE_MAX;
+  dirty_end = 0;
 }
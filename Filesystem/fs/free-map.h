@@ -7,6 +7,17 @@
 
 extern struct bitmap *free_map; /* Free map, one bit per sector. */
 
+/* Sectors per block group, the unit free_map_group_hint() picks. */
+#define FREE_MAP_GROUP_SECTORS 4096
+
+/* File system wide data kept in the free map file, after the bitmap.
+   Images written before it existed read as all zeros. */
+#define FREE_MAP_EXTRA_MAGIC 0x5845464d /* "MFEX" */
+struct free_map_extra {
+  uint32_t magic;               /* FREE_MAP_EXTRA_MAGIC. */
+  block_sector_t content_index; /* Inode of the content index, or 0. */
+};
+
 void free_map_init(void);
 void free_map_read(void);
 void free_map_create(void);
@@ -14,8 +25,20 @@ void free_map_open(void);
 void free_map_close(void);
 
 bool free_map_allocate(size_t, block_sector_t *);
+bool free_map_allocate_near(size_t, block_sector_t hint, block_sector_t *);
+bool free_map_allocate_best(size_t, block_sector_t *);
+size_t free_map_allocate_upto(size_t, block_sector_t hint, block_sector_t *);
+block_sector_t free_map_group_hint(void);
 void free_map_release(block_sector_t, size_t);
+void free_map_defer(size_t);
+void free_map_release_deferred(block_sector_t, size_t, size_t excess);
+void free_map_mark(block_sector_t, size_t);
+bool free_map_flush(void);
+void free_map_get_extra(struct free_map_extra *);
+bool free_map_put_extra(const struct free_map_extra *);
 
 int num_free_sectors(void);
+size_t free_map_available(void);
+bool free_map_in_use(block_sector_t);
 
 #endif /* fs/free-map.h */
@@ -14,14 +14,16 @@
 /* List files in the root directory. */
 int fsutil_ls(char *argv UNUSED) {
   struct dir *dir;
-  char name[NAME_MAX + 1];
+  struct dir_record records[32];
+  size_t cnt, i;
 
   printf("Files in the root directory:\n");
   dir = dir_open_root();
   if (dir == NULL)
     return 1;
-  while (dir_readdir(dir, name))
-    printf("%s\n", name);
+  while ((cnt = dir_readdir_bulk(dir, records, 32)) > 0)
+    for (i = 0; i < cnt; i++)
+      printf("%s\n", records[i].name);
   dir_close(dir);
   printf("End of listing.\n");
   return 0;
@@ -73,7 +75,7 @@ int fsutil_rm(char *file_name) {
   return filesys_remove(file_name);
 }
 
-int fsutil_create(const char *fname, unsigned isize) {
+int fsutil_create(const char *fname, offset_t isize) {
   if (strlen(fname) == 0 || strlen(fname) >= 255) {
     printf("Error with filename: %ld\n", strlen(fname));
     return 0;
@@ -81,7 +83,7 @@ int fsutil_create(const char *fname, unsigned isize) {
   return filesys_create(fname, isize, false); //, true);
 }
 
-int fsutil_write(char *file_name, const void *buffer, unsigned size) {
+offset_t fsutil_write(char *file_name, const void *buffer, offset_t size) {
   struct file *file_s = get_file_by_fname(file_name);
   if (file_s == NULL) {
     file_s = filesys_open(file_name);
@@ -93,7 +95,7 @@ int fsutil_write(char *file_name, const void *buffer, unsigned size) {
   return file_write(file_s, buffer, size);
 }
 
-int fsutil_read(char *file_name, void *buffer, unsigned size) {
+offset_t fsutil_read(char *file_name, void *buffer, offset_t size) {
   struct file *file_s = get_file_by_fname(file_name);
   if (file_s == NULL) {
     file_s = filesys_open(file_name);
@@ -105,7 +107,7 @@ int fsutil_read(char *file_name, void *buffer, unsigned size) {
   return file_read(file_s, buffer, size);
 }
 
-int fsutil_size(char *file_name) {
+offset_t fsutil_size(char *file_name) {
   struct file *file_s = get_file_by_fname(file_name);
   if (file_s == NULL) {
     file_s = filesys_open(file_name);
@@ -115,12 +117,12 @@ int fsutil_size(char *file_name) {
     add_to_file_table(file_s, file_name);
   }
   offset_t cur_offset = file_s->pos;
-  int length = file_length(file_s);
+  offset_t length = file_length(file_s);
   file_seek(file_s, cur_offset);
   return length;
 }
 
-int fsutil_seek(char *file_name, int offset) {
+int fsutil_seek(char *file_name, offset_t offset) {
   struct file *file_s = get_file_by_fname(file_name);
   if (file_s == NULL) {
     file_s = filesys_open(file_name);
@@ -133,6 +135,27 @@ int fsutil_seek(char *file_name, int offset) {
   return 0;
 }
 
+/* Grows FILE_NAME to SIZE bytes in one contiguous allocation.
+   Returns -1 if the file does not exist, 0 if there is not enough
+   space, and 1 on success. */
+int fsutil_fallocate(char *file_name, offset_t size) {
+  struct file *file_s = get_file_by_fname(file_name);
+  if (file_s == NULL) {
+    file_s = filesys_open(file_name);
+    if (file_s == NULL) {
+      return -1;
+    }
+    add_to_file_table(file_s, file_name);
+  }
+  return file_allocate(file_s, size);
+}
+
 void fsutil_close(char *file_name) { remove_from_file_table(file_name); }
 
 int fsutil_freespace() { return num_free_sectors(); }
+
+/* Prints file system statistics. */
+void fsutil_stats(void) {
+  block_print_stats();
+  dir_cache_print_stats();
+}
@@ -1,16 +1,20 @@
 #ifndef FILESYS_FSUTIL_H
 #define FILESYS_FSUTIL_H
 
+#include "off_t.h"
+
 int fsutil_ls(char *);
 int fsutil_cat(char *);
 int fsutil_rm(char *);
 
-int fsutil_create(const char *fname, unsigned isize);
-int fsutil_write(char *file_name, const void *buffer, unsigned size);
-int fsutil_read(char *file_name, void *buffer, unsigned size);
-int fsutil_size(char *file_name);
-int fsutil_seek(char *file_name, int offset);
+int fsutil_create(const char *fname, offset_t isize);
+offset_t fsutil_write(char *file_name, const void *buffer, offset_t size);
+offset_t fsutil_read(char *file_name, void *buffer, offset_t size);
+offset_t fsutil_size(char *file_name);
+int fsutil_seek(char *file_name, offset_t offset);
+int fsutil_fallocate(char *file_name, offset_t size);
 void fsutil_close(char *file_name);
 int fsutil_freespace();
+void fsutil_stats(void);
 
 #endif /* fs/fsutil.h */
@@ -1,6 +1,8 @@
+#define _GNU_SOURCE /* memmem() */
 #include "fsutil2.h"
 #include "bitmap.h"
 #include "cache.h"
+#include "content-index.h"
 #include "debug.h"
 #include "directory.h"
 #include "file.h"
@@ -11,10 +13,146 @@
 #include "off_t.h"
 #include "partition.h"
 #include "../interpreter.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* Bytes copy_in() and copy_out() move between the host and the disk
+   image at a time; a whole number of sectors. */
+#define COPY_CHUNK_SIZE (128 * BLOCK_SECTOR_SIZE)
+
+/* copy_in_dir() and copy_out_dir() read or write the host files on
+   COPY_DIR_THREADS threads, which run up to COPY_DIR_SLOTS files
+   ahead of or behind the calling thread.  Files of up to
+   COPY_DIR_STAGE_MAX bytes are handed over in memory; larger ones
+   are streamed by the calling thread itself, so memory use stays
+   bounded. */
+#define COPY_DIR_THREADS 4
+#define COPY_DIR_SLOTS (2 * COPY_DIR_THREADS)
+#define COPY_DIR_STAGE_MAX (4 * COPY_CHUNK_SIZE)
+
+/* Longest file name the disk image holds.  <dirent.h> redefines
+   NAME_MAX as the host's limit, so it cannot be relied on here. */
+#define IMAGE_NAME_MAX (sizeof((struct dir_entry *)0)->name - 1)
+
+/* Bytes find_file() reads from a file at a time; a whole number of
+   sectors. */
+#define FIND_CHUNK_SIZE (128 * BLOCK_SECTOR_SIZE)
+
+/* A file is fragmented if two of its consecutive data sectors are
+   more than FRAG_GAP_TOLERANCE sectors apart, not counting its own
+   indirect blocks between them.  fragmentation_report() buckets
+   files by their number of extents in powers of 2, jumps between
+   extents by length in powers of 4, and lists the FRAG_WORST files
+   with the most extents. */
+#define FRAG_GAP_TOLERANCE 3
+#define FRAG_EXTENT_BUCKETS 8
+#define FRAG_GAP_BUCKETS 7
+#define FRAG_WORST 5
+
+/* recover(0) looks for removed inodes among the free sectors by
+   reading the device directly, RECOVER_CHUNK_SECTORS at a time, on
+   RECOVER_THREADS threads including the calling one. */
+#define RECOVER_CHUNK_SECTORS 2048
+#define RECOVER_THREADS 4
+
+/**
+ * Writes the SIZE bytes of host file SRC to the start of FILE_S in
+ * whole-sector chunks, followed by the null terminator that
+ * fsutil_write() leaves after file data.
+ *
+ * @return The number of data bytes written, which is less than SIZE if
+ *         the disk image ran out of space, or -1 if out of memory.
+ */
+static long write_from_host(struct file *file_s, FILE *src, long size)
+{
+    // Reserve room for the data and the terminator in one contiguous
+    // piece. If that does not fit, write as much as does.
+    if (size > 0)
+        file_allocate(file_s, size + 1);
+
+    // One spare byte for the terminator after the last chunk.
+    char *buffer = malloc(COPY_CHUNK_SIZE + 1);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+
+    long total_bytes_written = 0;
+    size_t n;
+    while ((n = fread(buffer, 1, COPY_CHUNK_SIZE, src)) > 0)
+    {
+        size_t len = n;
+        if (total_bytes_written + (long)n == size)
+            buffer[len++] = '\0';
+
+        offset_t bytes_written = file_write_at(file_s, buffer, len, total_bytes_written);
+        total_bytes_written += bytes_written < (offset_t)n ? bytes_written : (offset_t)n;
+
+        // If we couldn't write all the bytes, stop
+        if (bytes_written < (offset_t)len)
+            break;
+    }
+    free(buffer);
+    return total_bytes_written;
+}
+
+/**
+ * Returns the length of FILE_S without the null terminator that
+ * files written through the shell end with; null bytes anywhere
+ * else are data.
+ */
+static offset_t data_length(struct file *file_s)
+{
+    offset_t length = file_length(file_s);
+    char last;
+    if (length > 0 && file_read_at(file_s, &last, 1, length - 1) == 1 && last == '\0')
+        length--;
+    return length;
+}
+
+/**
+ * Copies the first LENGTH bytes of FILE_S to host file DST in
+ * whole-sector chunks.
+ *
+ * @return Returns 0 on success, or an error code on failure.
+ */
+static int read_to_host(struct file *file_s, FILE *dst, offset_t length)
+{
+    char *buffer = malloc(COPY_CHUNK_SIZE);
+    if (buffer == NULL)
+    {
+        return FILE_READ_ERROR;
+    }
+
+    int result = 0;
+    for (offset_t pos = 0; pos < length;)
+    {
+        offset_t len = length - pos < COPY_CHUNK_SIZE ? length - pos : COPY_CHUNK_SIZE;
+        offset_t bytes_read = file_read_at(file_s, buffer, len, pos);
+        if (bytes_read <= 0)
+        {
+            result = FILE_READ_ERROR;
+            break;
+        }
+        if (fwrite(buffer, 1, bytes_read, dst) != (size_t)bytes_read)
+        {
+            result = FILE_WRITE_ERROR;
+            break;
+        }
+        pos += bytes_read;
+    }
+    free(buffer);
+    return result;
+}
+
 /**
  * Copies a file from the host filesystem into the
  * disk image's filesystem. If the file already
@@ -27,7 +165,7 @@ int copy_in(char *fname)
 {
 
     // Open the file from the host filesystem for reading
-    FILE *source_file = fopen(fname, "r");
+    FILE *source_file = fopen(fname, "rb");
     if (source_file == NULL)
     {
         return FILE_DOES_NOT_EXIST; // Error handling if the file couldn't be opened
@@ -48,40 +186,36 @@ int copy_in(char *fname)
         return FILE_CREATION_ERROR; // Error handling for file creation failure
     }
 
-    int c; // Use int to capture EOF
-    long bytes_written;
-    long total_bytes_written = 0;
-    int index = 0;
-
-    // While we can still read characters from the source file
-    while ((c = fgetc(source_file)) != EOF)
+    struct file *file_s = get_file_by_fname(fname);
+    if (file_s == NULL)
     {
-        char buffer[2] = {(char)c, '\0'}; // Cast the read character back to char and null-terminate the buffer
-        // char buffer[2];
-        // buffer[0]=c;
-
-        // Write the single byte to the disk image fs at the correct index
-        fsutil_seek(fname, index);
-        // Write 2 bytes to the file, one is the character,
-        // the other is the null terminator
-        bytes_written = fsutil_write(fname, buffer, 2);
-        index++;
-
-        total_bytes_written += bytes_written - 1; // Subtract 1 to account for the null terminator--quirk of the fsutil_write function
-
-        // If we couldn't write any bytes, break out of the loop
-        if (bytes_written == 0)
+        file_s = filesys_open(fname);
+        if (file_s == NULL)
         {
-            break;
+            fclose(source_file);
+            return FILE_CREATION_ERROR;
         }
+        add_to_file_table(file_s, fname);
     }
 
-    fsutil_seek(fname, index - 1); // Reset the index to before the null terminator
+    long total_bytes_written = write_from_host(file_s, source_file, file_size);
+    fclose(source_file);
+    if (total_bytes_written < 0)
+    {
+        return FILE_WRITE_ERROR;
+    }
+    if (total_bytes_written < file_size)
+    {
+        out_of_space = true;
+    }
+
+    // Leave the position on the last byte, as the byte-at-a-time copy did
+    file_seek(file_s, total_bytes_written > 0 ? total_bytes_written - 1 : 0);
 
     // If we couldn't write all the bytes, as predetermined, print the warning message.
     if (out_of_space)
     {
-        printf("Warning: could only write %ld out of %ld bytes (reached end of file).\n", total_bytes_written + 2, file_size);
+        printf("Warning: could only write %ld out of %ld bytes (reached end of file).\n", total_bytes_written, file_size);
     }
 
     // fsutil_close(fname); // Close the file in the disk image fs FOLLOW UP ON THIS
@@ -101,21 +235,15 @@ int copy_out(char *fname)
     // so that its index is reset to the beginning of the file.
     fsutil_close(fname);
 
-    // Determine the size of the file.
-    int filesize = fsutil_size(fname);
+    struct file *file_s = filesys_open(fname);
 
     // Return code for file not existing in the disk image.
-    if (filesize == -1)
+    if (file_s == NULL)
     {
         return FILE_DOES_NOT_EXIST;
     }
 
-    // Allocate a buffer to hold the file content.
-    char buffer[filesize + 1];
-    buffer[filesize] = '\0'; // Ensure the buffer is null-terminated.
-
-    // Read the content of the file from the disk image into the buffer.
-    fsutil_read(fname, buffer, filesize);
+    offset_t filesize = data_length(file_s);
 
     // If the file exists in the host filesystem, remove it, to clear it.
     remove(fname);
@@ -125,431 +253,1278 @@ int copy_out(char *fname)
     // If the file could not be opened; is NULL, return an error.
     if (!newfile)
     {
+        file_close(file_s);
         return FILE_CREATION_ERROR;
     }
 
-    // Write the buffer to the new file in the host filesystem.
-    // int written = fwrite(buffer, sizeof(char), filesize, newfile);
+    // Stream the file out in whole-sector chunks.
+    int result = read_to_host(file_s, newfile, filesize);
 
-    for (int i = 0; buffer[i] != '\0'; i++)
+    // Close the file in the disk image and the new file in the host filesystem.
+    file_close(file_s);
+    if (fclose(newfile) != 0 && result == 0)
     {
-        putc(buffer[i], newfile);
+        result = FILE_WRITE_ERROR;
     }
 
-    // Close the file in the disk image and the new file in the host filesystem.
-    fsutil_close(fname);
-    fclose(newfile);
-
-    // Return success.
-    return 0;
+    return result;
 }
 
 /**
- * Searches for and prints out all files in the root directory
- * that contain the specified pattern.
+ * DESCRIPTION:
+ * Reads every entry of the root directory, with its inode sector,
+ * length and type, in a single pass.
  *
- * @param pattern The text pattern to search for within each file.
+ * Sets *RECORDS to a malloc'd array the caller must free and
+ * returns its length, or 0 with *RECORDS NULL on failure.
  */
-void find_file(char *pattern)
+size_t getAllRecordsInRoot(struct dir_record **records)
 {
     struct dir *root_dir = dir_open_root();
+    size_t cnt = 0, cap = 64;
+    struct dir_record *arr = malloc(cap * sizeof *arr);
 
-    char file_name[NAME_MAX + 1]; // To store the file name
-    while (dir_readdir(root_dir, file_name))
-    { // Iterate over all files in the root directory in disk image fs
-
-        // Allocate buffer to read file contents into
-        off_t len_file = fsutil_size(file_name);
-        char *buffer = malloc((len_file + 1) * sizeof(char));
-        // If malloc fails, close the file and continue to the next file
-        if (buffer == NULL)
-        {
-            fsutil_close(file_name);
-            continue;
-        }
-
-        // Read file contents
-        off_t bytes_read = fsutil_read(file_name, buffer, len_file);
-        buffer[bytes_read] = '\0'; // Null-terminate the buffer
+    *records = NULL;
+    if (root_dir == NULL || arr == NULL)
+    {
+        dir_close(root_dir);
+        free(arr);
+        return 0;
+    }
 
-        // Search for the pattern in the file contents
-        if (strstr(buffer, pattern) != NULL)
+    size_t n;
+    while ((n = dir_readdir_bulk(root_dir, arr + cnt, cap - cnt)) > 0)
+    {
+        cnt += n;
+        if (cnt == cap)
         {
-            printf("%s\n", file_name); // Print the file name if the pattern is found
+            struct dir_record *bigger = realloc(arr, 2 * cap * sizeof *arr);
+            if (bigger == NULL)
+                break;
+            arr = bigger;
+            cap *= 2;
         }
-
-        // Freeing up each iteration
-        free(buffer);
-        fsutil_close(file_name);
     }
 
-    // Close root directory when finished
     dir_close(root_dir);
+    *records = arr;
+    return cnt;
 }
-/**
- * DESCRIPTION:
- * Gets all file names in root
- *
- * return arr is NULL terminated
- */
-char **getAllFilesInRoot()
+
+/* A staging buffer of a directory copy, holding one file on its way
+   between the host and the disk image. */
+struct copy_slot
 {
-    struct dir *root_dir = dir_open_root();
-    int num_files_in_root = 0;
-    char file_name[NAME_MAX + 1];
+    size_t seq;  /* Index of the file the slot is for. */
+    bool ready;  /* Filled by its producer? */
+    bool staged; /* File in DATA, or too large and copied directly? */
+    bool failed; /* Producer could not read the file? */
+    long size;   /* Length of the file in bytes. */
+    char *data;  /* COPY_DIR_STAGE_MAX bytes, plus a terminator. */
+};
 
-    if (root_dir == NULL)
-    {
-        return NULL;
-    }
+/* A directory copy, shared between the calling thread, which does all
+   the work on the disk image, and the threads that read or write the
+   host files. */
+struct copy_dir_job
+{
+    const char *host_dir;              /* Host directory. */
+    char (*names)[IMAGE_NAME_MAX + 1]; /* Files to copy, in order. */
+    size_t cnt;                        /* Number of NAMES. */
+    size_t next;                       /* Next file for a host thread. */
+    size_t failed_cnt;                 /* Files that could not be copied. */
+    long long byte_cnt;                /* Bytes copied. */
+    struct copy_slot slots[COPY_DIR_SLOTS];
+    pthread_mutex_t lock; /* Guards everything above but NAMES. */
+    pthread_cond_t changed;
+};
 
-    while (dir_readdir(root_dir, file_name))
+/* Sets up JOB to copy CNT files NAMES from or to HOST_DIR.
+   Returns false if out of memory. */
+static bool copy_dir_init(struct copy_dir_job *job, const char *host_dir, char (*names)[IMAGE_NAME_MAX + 1], size_t cnt)
+{
+    job->host_dir = host_dir;
+    job->names = names;
+    job->cnt = cnt;
+    job->next = 0;
+    job->failed_cnt = 0;
+    job->byte_cnt = 0;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->changed, NULL);
+    for (size_t i = 0; i < COPY_DIR_SLOTS; i++)
     {
-        num_files_in_root++;
+        job->slots[i].seq = i;
+        job->slots[i].ready = false;
+        job->slots[i].data = malloc(COPY_DIR_STAGE_MAX + 1);
+        if (job->slots[i].data == NULL)
+        {
+            while (i-- > 0)
+                free(job->slots[i].data);
+            return false;
+        }
     }
+    return true;
+}
 
-    dir_close(root_dir);
+/* Frees the resources of JOB. */
+static void copy_dir_done(struct copy_dir_job *job)
+{
+    for (size_t i = 0; i < COPY_DIR_SLOTS; i++)
+        free(job->slots[i].data);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->changed);
+}
 
-    root_dir = dir_open_root();
+/* Returns the index of the next file for a host thread of JOB, or
+   JOB->cnt if there are none left. */
+static size_t copy_dir_claim(struct copy_dir_job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    size_t i = job->next < job->cnt ? job->next++ : job->cnt;
+    pthread_mutex_unlock(&job->lock);
+    return i;
+}
 
-    if (root_dir == NULL)
-    {
-        return NULL;
-    }
+/* Waits until the slot for file I of JOB is empty, if READY is false,
+   or filled, if READY is true, and returns it. */
+static struct copy_slot *copy_slot_wait(struct copy_dir_job *job, size_t i, bool ready)
+{
+    struct copy_slot *slot = &job->slots[i % COPY_DIR_SLOTS];
+    pthread_mutex_lock(&job->lock);
+    while (slot->seq != i || slot->ready != ready)
+        pthread_cond_wait(&job->changed, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    return slot;
+}
 
-    char **names = malloc((sizeof(char *) * num_files_in_root) + sizeof(char *));
-    names[num_files_in_root] = NULL;
+/* Marks SLOT of JOB filled. */
+static void copy_slot_fill(struct copy_dir_job *job, struct copy_slot *slot)
+{
+    pthread_mutex_lock(&job->lock);
+    slot->ready = true;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
 
-    int i = 0;
-    while (dir_readdir(root_dir, file_name))
-    {
-        names[i++] = strdup(file_name);
-    }
+/* Empties SLOT of JOB and hands it on to the file COPY_DIR_SLOTS
+   further on. FAILED and BYTES count towards the totals of JOB. */
+static void copy_slot_release(struct copy_dir_job *job, struct copy_slot *slot, bool failed, long bytes)
+{
+    pthread_mutex_lock(&job->lock);
+    job->failed_cnt += failed;
+    job->byte_cnt += bytes;
+    slot->ready = false;
+    slot->seq += COPY_DIR_SLOTS;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
 
-    dir_close(root_dir);
+/* Stores the host path of file I of JOB into PATH. */
+static void copy_dir_path(const struct copy_dir_job *job, size_t i, char path[PATH_MAX])
+{
+    snprintf(path, PATH_MAX, "%s/%s", job->host_dir, job->names[i]);
+}
 
-    return names;
+/* Starts up to COPY_DIR_THREADS threads running WORKER on JOB and
+   stores them into THREADS. Returns how many started. */
+static size_t copy_dir_start(struct copy_dir_job *job, void *(*worker)(void *), pthread_t threads[COPY_DIR_THREADS])
+{
+    size_t n = 0;
+    while (n < COPY_DIR_THREADS && n < job->cnt && pthread_create(&threads[n], NULL, worker, job) == 0)
+        n++;
+    return n;
 }
 
-/**
- * DESCRIPTION:
- * Gets number of fragmentable files (i.e files that have 2 or more blocks)
- */
-int getNumberOfFragmentableFiles(char **names)
+/* Prints how many files and bytes JOB copied since START. */
+static void copy_dir_report(const struct copy_dir_job *job, const struct timespec *start)
 {
-    int count = 0;
-    for (int i = 0; names[i] != NULL; i++)
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    double mb = job->byte_cnt / (1024.0 * 1024.0);
+    size_t copied = job->cnt - job->failed_cnt;
+    if (secs <= 0)
+        secs = 1e-9;
+    printf("Copied %zu files (%.2f MB) in %.3f s: %.0f files/s, %.2f MB/s.\n", copied, mb, secs, copied / secs, mb / secs);
+    if (job->failed_cnt > 0)
+        printf("Warning: %zu files could not be copied.\n", job->failed_cnt);
+}
+
+/* Reads file I of JOB from the host into its slot, or only notes its
+   size if it is too large to stage. */
+static void copy_in_stage(struct copy_dir_job *job, size_t i)
+{
+    struct copy_slot *slot = copy_slot_wait(job, i, false);
+    char path[PATH_MAX];
+    copy_dir_path(job, i, path);
+
+    slot->failed = true;
+    slot->staged = false;
+    FILE *src = fopen(path, "rb");
+    if (src != NULL)
     {
-        struct file *file_s = get_file_by_fname(names[i]);
-        if (file_s == NULL)
+        fseek(src, 0, SEEK_END);
+        slot->size = ftell(src);
+        fseek(src, 0, SEEK_SET);
+        if (slot->size > COPY_DIR_STAGE_MAX)
         {
-            file_s = filesys_open(names[i]);
+            slot->failed = false;
         }
+        else if (slot->size >= 0 && fread(slot->data, 1, slot->size, src) == (size_t)slot->size)
+        {
+            slot->data[slot->size] = '\0';
+            slot->staged = true;
+            slot->failed = false;
+        }
+        fclose(src);
+    }
+    copy_slot_fill(job, slot);
+}
+
+/* Host thread of copy_in_dir(). */
+static void *copy_in_worker(void *job_)
+{
+    struct copy_dir_job *job = job_;
+    size_t i;
+    while ((i = copy_dir_claim(job)) < job->cnt)
+        copy_in_stage(job, i);
+    return NULL;
+}
 
-        // checks if it has 2 or more blocks
-        if (file_s->inode->data.direct_blocks[0] != 0 && file_s->inode->data.direct_blocks[1] != 0)
+/* Creates file I of JOB in the disk image from its slot, or straight
+   from the host if it was too large to stage. Returns the number of
+   bytes written, or -1 on failure, in which case no file is left
+   behind: a partial copy is removed again. */
+static long copy_in_commit(struct copy_dir_job *job, size_t i, struct copy_slot *slot)
+{
+    const char *name = job->names[i];
+    if (slot->failed)
+    {
+        printf("Error: could not read %s from the host.\n", name);
+        return -1;
+    }
+    if (!fsutil_create(name, 0))
+    {
+        printf("Error: could not create %s.\n", name);
+        return -1;
+    }
+    struct file *file_s = filesys_open(name);
+    if (file_s == NULL)
+    {
+        printf("Error: could not create %s.\n", name);
+        filesys_remove(name);
+        return -1;
+    }
+
+    long written;
+    if (slot->staged)
+    {
+        // The data and its terminator in one contiguous piece, if it
+        // fits; empty files stay empty, as with copy_in().
+        written = 0;
+        if (slot->size > 0)
         {
-            count++;
+            file_allocate(file_s, slot->size + 1);
+            written = file_write_at(file_s, slot->data, slot->size + 1, 0);
+            if (written > slot->size)
+                written = slot->size;
         }
+    }
+    else
+    {
+        char path[PATH_MAX];
+        copy_dir_path(job, i, path);
+        FILE *src = fopen(path, "rb");
+        written = src != NULL ? write_from_host(file_s, src, slot->size) : -1;
+        if (src != NULL)
+            fclose(src);
+    }
+    file_close(file_s);
 
-        fsutil_close(names[i]);
+    if (written < 0)
+        printf("Error: could not copy %s into the disk image.\n", name);
+    else if (written < slot->size)
+        printf("Error: could only write %ld out of %ld bytes of %s (reached end of file).\n", written, slot->size, name);
+    if (written < slot->size)
+    {
+        filesys_remove(name);
+        return -1;
     }
+    return written;
+}
 
-    return count;
+/* qsort() comparison of two file names. */
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
 }
 
 /**
  * DESCRIPTION:
- * Gets number of fragmented files
+ * Copies every regular file of host directory HOST_DIR into the root
+ * directory of the disk image, in name order. Host threads read the
+ * files ahead of the calling thread, which creates and writes them
+ * in the disk image. Files that already exist in the disk image, or
+ * whose names are longer than IMAGE_NAME_MAX, are skipped.
  *
- * PARAMS:
- * names: names of all the files in the root
+ * @return Returns 0 on success, or an error code if HOST_DIR cannot
+ *         be read.
  */
-int getNumberOfFragmentedFiles(char **names)
+int copy_in_dir(char *host_dir)
 {
-    int count = 0;
-    for (int i = 0; names[i] != NULL; i++)
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL)
     {
+        return FILE_DOES_NOT_EXIST;
+    }
 
-        struct file *file_s = get_file_by_fname(names[i]);
-        if (file_s == NULL)
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t cnt = 0, cap = 64;
+    char(*names)[IMAGE_NAME_MAX + 1] = malloc(cap * sizeof *names);
+    struct dirent *de;
+    while (names != NULL && (de = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof path, "%s/%s", host_dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (strlen(de->d_name) > IMAGE_NAME_MAX)
         {
-            file_s = filesys_open(names[i]);
+            printf("Warning: skipping %s, its name is too long.\n", de->d_name);
+            continue;
         }
-
-        block_sector_t *arr = get_inode_data_sectors(file_s->inode);
-        size_t num_sectors = bytes_to_sectors(file_s->inode->data.length);
-        bool fragmentable = false;
-
-        // Checks if its fragmented
-        for (int j = 0; j < num_sectors - 1; j++)
+        if (cnt == cap)
         {
-            if (abs(arr[j] - arr[j + 1]) > 3)
-            {
-                fragmentable = true;
-            }
-            if (fragmentable)
-            {
-                count++;
+            char(*bigger)[IMAGE_NAME_MAX + 1] = realloc(names, 2 * cap * sizeof *names);
+            if (bigger == NULL)
                 break;
-            }
+            names = bigger;
+            cap *= 2;
         }
+        strcpy(names[cnt++], de->d_name);
+    }
+    closedir(dir);
+    if (names == NULL)
+    {
+        return FILE_READ_ERROR;
+    }
+    qsort(names, cnt, sizeof *names, compare_names);
 
-        free(arr);
-        fsutil_close(names[i]);
+    struct copy_dir_job job;
+    if (!copy_dir_init(&job, host_dir, names, cnt))
+    {
+        free(names);
+        return FILE_READ_ERROR;
+    }
+    pthread_t threads[COPY_DIR_THREADS];
+    size_t thread_cnt = copy_dir_start(&job, copy_in_worker, threads);
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        // Without host threads, read each file just before writing it.
+        if (thread_cnt == 0)
+            copy_in_stage(&job, copy_dir_claim(&job));
+        struct copy_slot *slot = copy_slot_wait(&job, i, true);
+        long written = copy_in_commit(&job, i, slot);
+        copy_slot_release(&job, slot, written < 0, written < 0 ? 0 : written);
     }
 
-    return count;
+    for (size_t i = 0; i < thread_cnt; i++)
+        pthread_join(threads[i], NULL);
+    copy_dir_report(&job, &start);
+    copy_dir_done(&job);
+    free(names);
+    return 0;
 }
 
-void fragmentation_degree()
+/* Writes file I of JOB from its slot to the host, unless the calling
+   thread already copied it because it was too large to stage. */
+static void copy_out_unstage(struct copy_dir_job *job, size_t i)
 {
-    // gets all file names in roots
-    char **names = getAllFilesInRoot();
+    struct copy_slot *slot = copy_slot_wait(job, i, true);
+    bool failed = slot->failed;
 
-    int nb_fragmented_files = getNumberOfFragmentedFiles(names);
-    int nb_fragmentable_files = getNumberOfFragmentableFiles(names);
+    if (slot->staged && !failed)
+    {
+        char path[PATH_MAX];
+        copy_dir_path(job, i, path);
+        FILE *dst = fopen(path, "wb");
+        failed = dst == NULL;
+        if (dst != NULL)
+        {
+            failed = fwrite(slot->data, 1, slot->size, dst) != (size_t)slot->size;
+            failed |= fclose(dst) != 0;
+        }
+        if (failed)
+            printf("Error: could not write %s to the host.\n", path);
+    }
+    copy_slot_release(job, slot, failed, failed ? 0 : slot->size);
+}
 
-    // computes fragmentation degree
-    // Num fragmentable files: 90
-    printf("Num fragmentable files: %d\n", nb_fragmentable_files);
+/* Host thread of copy_out_dir(). */
+static void *copy_out_worker(void *job_)
+{
+    struct copy_dir_job *job = job_;
+    size_t i;
+    while ((i = copy_dir_claim(job)) < job->cnt)
+        copy_out_unstage(job, i);
+    return NULL;
+}
 
-    printf("Num fragmented files: %d\n", nb_fragmented_files);
+/* Reads file I of JOB from the disk image into its slot, or copies it
+   to the host directly if it is too large to stage. */
+static void copy_out_stage(struct copy_dir_job *job, size_t i, struct copy_slot *slot)
+{
+    const char *name = job->names[i];
+    struct file *file_s = filesys_open(name);
 
-    double frag_deg = ((double)nb_fragmented_files) / ((double)nb_fragmentable_files);
-    printf("Fragmentation pct: %f\n", frag_deg);
+    slot->failed = true;
+    slot->staged = false;
+    if (file_s == NULL)
+    {
+        printf("Error: could not open %s.\n", name);
+        return;
+    }
 
-    // frees names array
-    for (int i = 0; names[i] != NULL; i++)
+    slot->size = data_length(file_s);
+    if (slot->size <= COPY_DIR_STAGE_MAX)
     {
-        free(names[i]);
+        slot->staged = true;
+        slot->failed = file_read_at(file_s, slot->data, slot->size, 0) != slot->size;
     }
-    free(names);
+    else
+    {
+        char path[PATH_MAX];
+        copy_dir_path(job, i, path);
+        FILE *dst = fopen(path, "wb");
+        if (dst != NULL)
+        {
+            slot->failed = read_to_host(file_s, dst, slot->size) != 0;
+            slot->failed |= fclose(dst) != 0;
+        }
+    }
+    if (slot->failed)
+        printf("Error: could not copy %s to the host.\n", name);
+    file_close(file_s);
 }
 
-struct filebuffer {
-    char *filename;
-    char *file_contents;
-    int filesize;
-};
+/**
+ * DESCRIPTION:
+ * Copies every file of the root directory of the disk image into host
+ * directory HOST_DIR, which is created if it does not exist; host
+ * files of the same names are overwritten. The calling thread reads
+ * the files from the disk image ahead of host threads that write them
+ * out.
+ *
+ * @return Returns 0 on success, or an error code if HOST_DIR cannot
+ *         be created.
+ */
+int copy_out_dir(char *host_dir)
+{
+    if (mkdir(host_dir, 0777) != 0 && errno != EEXIST)
+    {
+        return FILE_CREATION_ERROR;
+    }
 
-static struct filebuffer *init_file_contents(char *filename, char* buffer, int filesize) {
-    struct filebuffer *file = malloc(sizeof(struct filebuffer));
-    file->filename = filename;
-    file->file_contents = buffer;
-    file->filesize = filesize;
-    return file;
-}
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-static void free_file_contents(struct filebuffer *buffer) {
-    free(buffer->file_contents);
-    free(buffer->filename);
-    free(buffer);
+    struct dir_record *records;
+    size_t record_cnt = getAllRecordsInRoot(&records);
+    char(*names)[IMAGE_NAME_MAX + 1] = malloc((record_cnt + 1) * sizeof *names);
+    if (names == NULL)
+    {
+        free(records);
+        return FILE_READ_ERROR;
+    }
+    size_t cnt = 0;
+    for (size_t i = 0; i < record_cnt; i++)
+    {
+        if (!records[i].is_dir)
+            strcpy(names[cnt++], records[i].name);
+    }
+    free(records);
+
+    struct copy_dir_job job;
+    if (!copy_dir_init(&job, host_dir, names, cnt))
+    {
+        free(names);
+        return FILE_READ_ERROR;
+    }
+    pthread_t threads[COPY_DIR_THREADS];
+    size_t thread_cnt = copy_dir_start(&job, copy_out_worker, threads);
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        struct copy_slot *slot = copy_slot_wait(&job, i, false);
+        copy_out_stage(&job, i, slot);
+        copy_slot_fill(&job, slot);
+        // Without host threads, write each file just after reading it.
+        if (thread_cnt == 0)
+            copy_out_unstage(&job, copy_dir_claim(&job));
+    }
+
+    for (size_t i = 0; i < thread_cnt; i++)
+        pthread_join(threads[i], NULL);
+    copy_dir_report(&job, &start);
+    copy_dir_done(&job);
+    free(names);
+    return 0;
 }
 
-int defragment()
+/* A find_file() pattern. */
+struct find_pattern
 {
-    int return_code = 0;
+    const char *bytes;
+    size_t len;
+};
 
-    // gets number of files in root
-    int filecount = 0;
-    char file_name[NAME_MAX + 10];
+/* Returns true if PAT occurs in the N bytes at BUF.  glibc's memmem()
+   skips ahead Horspool-style on short patterns and uses the two-way
+   algorithm on long ones, and unlike strstr() does not stop at null
+   bytes. */
+static bool find_pattern_in(const struct find_pattern *pat, const char *buf, size_t n)
+{
+    return memmem(buf, n, pat->bytes, pat->len) != NULL;
+}
 
-    int file_contents_ptr = 100;
-    struct filebuffer **filebuffers = malloc(sizeof(struct filebuffer*) * file_contents_ptr);
+/* Returns true if any of the CNT patterns PATS occurs in FILE_S.
+   BUFFER holds FIND_CHUNK_SIZE bytes plus KEEP, the longest pattern
+   length less one: that many bytes of each chunk are carried over
+   to the next, so that matches across chunks are found.  If SET is
+   not null, the whole file is read and fed to it, even after a
+   match, so that the file can be added to the content index. */
+static bool find_in_file(struct file *file_s, const struct find_pattern *pats, size_t cnt, char *buffer, size_t keep,
+                         struct trigram_set *set)
+{
+    offset_t length = file_length(file_s);
+    size_t carried = 0;
+    bool found = false;
 
-    struct dir *root_dir = dir_open_root();
-    if (!root_dir)
-        return handle_error(FILESYSTEM_ERROR);
+    // An empty pattern is found even in an empty file.
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (pats[i].len == 0)
+            found = true;
+    }
 
-    // gets file names and their contents and saves them into the buffers
-    while (dir_readdir(root_dir, file_name)) {      
+    for (offset_t pos = 0; pos < length && (!found || set != NULL);)
+    {
+        offset_t bytes_read = file_read_at(file_s, buffer + carried, FIND_CHUNK_SIZE, pos);
+        if (bytes_read <= 0)
+            break;
+        pos += bytes_read;
+        if (set != NULL)
+            trigram_set_feed(set, buffer + carried, bytes_read);
 
-        int filesize = fsutil_size(file_name);
-        char *filebuffer = malloc(sizeof(char) * (filesize + 1));
-        
-        // reads file into filebuffer
-        int code = fsutil_read(file_name, filebuffer, filesize);
-        if (code == -1)
+        size_t n = carried + bytes_read;
+        for (size_t i = 0; !found && i < cnt; i++)
         {
-            dir_close(root_dir);
-            free(filebuffer);
-            return_code = FILE_READ_ERROR;
-            goto FreeBuffers;
+            if (find_pattern_in(&pats[i], buffer, n))
+                found = true;
         }
 
-        fsutil_close(file_name);
-
-        // adds filename and file contents to filebuffers array
-        filebuffers[filecount] = init_file_contents(strdup(file_name), filebuffer, filesize);
-        filecount++;
+        carried = n < keep ? n : keep;
+        memmove(buffer, buffer + n - carried, carried);
+    }
+    return found;
+}
 
-        // resizes if necessary 
-        if(filecount >= file_contents_ptr) {
-            filebuffers = realloc(filebuffers, file_contents_ptr * 2);
-            file_contents_ptr*=2;
-        }
+/**
+ * Searches for and prints out all files in the root directory
+ * that contain at least one of the CNT patterns PATTERNS. Each file
+ * is read once, a chunk at a time, whatever the number of patterns;
+ * null bytes in files are searched like any other.
+ *
+ * If the disk image has a content index, files it rules out are not
+ * read at all, and files it does not cover yet are read in full and
+ * added to it.
+ */
+void find_files(char **patterns, size_t cnt)
+{
+    struct find_pattern *pats = malloc(cnt * sizeof *pats);
+    size_t keep = 0;
+    if (pats == NULL)
+        return;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        pats[i].bytes = patterns[i];
+        pats[i].len = strlen(patterns[i]);
+        if (pats[i].len > keep + 1)
+            keep = pats[i].len - 1;
     }
 
-    dir_close(root_dir);
+    char *buffer = malloc(FIND_CHUNK_SIZE + keep);
+    struct content_query *query = content_index_query(patterns, cnt);
+    struct trigram_set *set = NULL;
+    struct dir_record *records;
+    size_t record_cnt = getAllRecordsInRoot(&records);
+
+    for (size_t i = 0; buffer != NULL && i < record_cnt; i++)
+    { // Iterate over all files in the root directory in disk image fs
+        if (records[i].is_dir || !content_query_may_match(query, records[i].inode_sector))
+            continue;
 
-     // deletes files
-    for(int i = 0; i < filecount; i++) {
-        if (!fsutil_rm(filebuffers[i]->filename))
+        struct file *file_s = filesys_open(records[i].name);
+        if (file_s == NULL)
+            continue;
+
+        bool unindexed = !content_index_covers(records[i].inode_sector);
+        if (unindexed && set == NULL)
+            set = trigram_set_create();
+        if (find_in_file(file_s, pats, cnt, buffer, keep, unindexed ? set : NULL))
         {
-            return_code = FILESYSTEM_ERROR;
-            goto FreeBuffers;
+            printf("%s\n", records[i].name); // Print the file name if a pattern is found
         }
+        if (unindexed && set != NULL)
+            content_index_add(records[i].inode_sector, set);
+        file_close(file_s);
     }
 
-    // Creates new files
-    for (int i = 0; i < filecount; i++)
-    {
-        char *filename = filebuffers[i]->filename;
-        char *filecontents = filebuffers[i]->file_contents;
-        int filesize = filebuffers[i]->filesize;
+    trigram_set_destroy(set);
+    content_query_free(query);
+    free(records);
+    free(buffer);
+    free(pats);
+}
 
-        if (!fsutil_create(filename, filesize))
-        {
-            return_code = FILE_CREATION_ERROR;
-            break;
-        }
+/**
+ * DESCRIPTION:
+ * Gives the disk image a content index, unless it already has one,
+ * and adds every file of the root directory it does not cover yet.
+ * Prints how many files were indexed and how long it took.
+ *
+ * @return Returns 0 on success, or an error code if the index
+ *         cannot be created.
+ */
+int build_content_index(void)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!content_index_create())
+        return FILE_CREATION_ERROR;
+    char *buffer = malloc(FIND_CHUNK_SIZE);
+    struct trigram_set *set = trigram_set_create();
+    if (buffer == NULL || set == NULL)
+    {
+        free(buffer);
+        trigram_set_destroy(set);
+        return FILE_READ_ERROR;
+    }
 
-        fsutil_write(filename, filecontents, filesize);
+    struct dir_record *records;
+    size_t record_cnt = getAllRecordsInRoot(&records);
+    size_t indexed = 0;
+    for (size_t i = 0; i < record_cnt; i++)
+    {
+        if (records[i].is_dir || content_index_covers(records[i].inode_sector))
+            continue;
+        struct file *file_s = filesys_open(records[i].name);
+        if (file_s == NULL)
+            continue;
+        find_in_file(file_s, NULL, 0, buffer, 0, set);
+        content_index_add(records[i].inode_sector, set);
+        file_close(file_s);
+        indexed++;
     }
+    free(records);
+    trigram_set_destroy(set);
+    free(buffer);
 
-    // frees memory
-    FreeBuffers:;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Indexed %zu files in %.3f s.\n", indexed, secs);
+    return 0;
+}
 
-    for (int i = 0; i < filecount; i++) {
-        free_file_contents(filebuffers[i]);
+/**
+ * Searches for and prints out all files in the root directory
+ * that contain the specified pattern.
+ *
+ * @param pattern The text pattern to search for within each file.
+ */
+void find_file(char *pattern)
+{
+    find_files(&pattern, 1);
+}
+
+/* Fragmentation of the files in the root directory, gathered in one
+   pass over their block maps by frag_scan(). */
+struct frag_report
+{
+    size_t files;        // Files and directories scanned
+    size_t fragmentable; // Those with two data sectors or more
+    size_t fragmented;   // Those with a jump of more than FRAG_GAP_TOLERANCE
+    size_t sectors;      // Data sectors
+    size_t extents;      // Runs of consecutive data sectors
+    size_t jumps;        // Breaks between extents
+    size_t backward;     // Jumps to a lower sector
+    size_t by_extents[FRAG_EXTENT_BUCKETS];
+    size_t by_gap[FRAG_GAP_BUCKETS];
+    struct frag_worst
+    {
+        size_t record; // Index in the records of frag_scan()
+        size_t extents;
+        size_t sectors;
+    } worst[FRAG_WORST]; // Most extents first
+    size_t worst_cnt;
+
+    // The file being scanned
+    size_t file_sectors;
+    size_t file_extents;
+    bool file_fragmented;
+    block_sector_t file_last; // Last sector of its latest extent
+};
+
+/* Returns the by_gap bucket of a jump of DIST sectors: the
+   tolerated ones, then one per power of 4. */
+static size_t frag_gap_bucket(size_t dist)
+{
+    size_t bucket = 0;
+    if (dist <= FRAG_GAP_TOLERANCE)
+        return 0;
+    while (dist >= 4 && bucket + 1 < FRAG_GAP_BUCKETS)
+    {
+        dist /= 4;
+        bucket++;
     }
-    free(filebuffers);
-  
-    return return_code;
+    return bucket;
 }
 
-int defragment_()
+/* Returns the by_extents bucket of a file with CNT extents, one per
+   power of 2. */
+static size_t frag_extent_bucket(size_t cnt)
 {
+    size_t bucket = 0;
+    while (cnt >= 2 && bucket + 1 < FRAG_EXTENT_BUCKETS)
+    {
+        cnt /= 2;
+        bucket++;
+    }
+    return bucket;
+}
 
-    struct dir *root_dir = dir_open_root();
-    int num_files_in_root = 0;
-    char file_name[NAME_MAX + 1];
+/* inode_map_extents() callback: adds the extent of LEN sectors from
+   START, CNT of them data sectors, to the file being scanned by the
+   frag_report AUX. */
+static void frag_extent(block_sector_t start, size_t len, size_t cnt, void *aux)
+{
+    struct frag_report *r = aux;
+    if (r->file_extents > 0)
+    {
+        long jump = (long)start - (long)r->file_last;
+        size_t dist = jump < 0 ? -jump : jump;
+        if (dist > FRAG_GAP_TOLERANCE)
+            r->file_fragmented = true;
+        if (jump < 0)
+            r->backward++;
+        r->by_gap[frag_gap_bucket(dist)]++;
+        r->jumps++;
+    }
+    r->file_extents++;
+    r->file_sectors += cnt;
+    r->file_last = start + len - 1;
+}
 
-    if (root_dir == NULL)
+/* Adds the file scanned last, RECORD in the records of frag_scan(),
+   to the totals of R. */
+static void frag_file_done(struct frag_report *r, size_t record)
+{
+    r->files++;
+    r->fragmentable += r->file_sectors >= 2;
+    r->fragmented += r->file_fragmented;
+    r->sectors += r->file_sectors;
+    r->extents += r->file_extents;
+    if (r->file_extents == 0)
+        return;
+    r->by_extents[frag_extent_bucket(r->file_extents)]++;
+
+    // Keep the FRAG_WORST files with the most extents, in order.
+    size_t i = r->worst_cnt < FRAG_WORST ? r->worst_cnt++ : FRAG_WORST;
+    while (i > 0 && r->worst[i - 1].extents < r->file_extents)
     {
-        return handle_error(FILESYSTEM_ERROR);
+        if (i < FRAG_WORST)
+            r->worst[i] = r->worst[i - 1];
+        i--;
     }
+    if (i < FRAG_WORST)
+        r->worst[i] = (struct frag_worst){record, r->file_extents, r->file_sectors};
+}
 
-    while (dir_readdir(root_dir, file_name))
+/**
+ * DESCRIPTION:
+ * Computes the fragmentation of every file and directory in the
+ * root directory into R, from the block maps of their inodes alone:
+ * one directory scan, no file opened and no file data read. One
+ * scratch map serves inode_map_extents() for all of the files.
+ *
+ * @return Returns the number of records stored into *RECORDS, which
+ *         the caller must free.
+ */
+static size_t frag_scan(struct frag_report *r, struct dir_record **records)
+{
+    size_t record_cnt = getAllRecordsInRoot(records);
+    struct inode_extent_map map = {NULL, 0};
+
+    memset(r, 0, sizeof *r);
+    for (size_t i = 0; i < record_cnt; i++)
     {
-        num_files_in_root++;
+        r->file_sectors = r->file_extents = 0;
+        r->file_fragmented = false;
+        if (inode_map_extents((*records)[i].inode_sector, frag_extent, r, &map))
+            frag_file_done(r, i);
     }
+    inode_extent_map_free(&map);
+    return record_cnt;
+}
 
-    dir_close(root_dir);
+/**
+ * DESCRIPTION:
+ * Prints the number of fragmentable files (those with two data
+ * sectors or more), of fragmented files (those with two consecutive
+ * data sectors more than FRAG_GAP_TOLERANCE sectors apart, not
+ * counting the file's own indirect blocks), and the ratio of the two.
+ */
+void fragmentation_degree()
+{
+    struct frag_report r;
+    struct dir_record *records;
+    frag_scan(&r, &records);
+    free(records);
 
-    root_dir = dir_open_root();
+    // computes fragmentation degree
+    // Num fragmentable files: 90
+    printf("Num fragmentable files: %zu\n", r.fragmentable);
+
+    printf("Num fragmented files: %zu\n", r.fragmented);
+
+    double frag_deg = ((double)r.fragmented) / ((double)r.fragmentable);
+    printf("Fragmentation pct: %f\n", frag_deg);
+}
+
+/**
+ * DESCRIPTION:
+ * Prints what fragmentation_degree() does, followed by how the data
+ * sectors of the files are laid out: how many extents (runs of
+ * consecutive sectors) files have, how far apart consecutive extents
+ * are, and the files with the most extents. A file's score is its
+ * extents less one over its sectors less one, from 0 for a
+ * contiguous file to 1 when no two sectors are adjacent.
+ */
+void fragmentation_report()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct frag_report r;
+    struct dir_record *records;
+    frag_scan(&r, &records);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    printf("Files: %zu, %zu fragmentable, %zu fragmented (%.1f%%)\n", r.files, r.fragmentable, r.fragmented,
+           r.fragmentable > 0 ? 100.0 * r.fragmented / r.fragmentable : 0.0);
+    printf("Data sectors: %zu in %zu extents\n", r.sectors, r.extents);
 
-    if (root_dir == NULL)
+    printf("Extents per file:\n");
+    for (size_t i = 0; i < FRAG_EXTENT_BUCKETS; i++)
     {
-        return handle_error(FILESYSTEM_ERROR);
+        size_t lo = (size_t)1 << i, hi = 2 * lo - 1;
+        if (i + 1 == FRAG_EXTENT_BUCKETS)
+            printf("  %6zu+     %zu\n", lo, r.by_extents[i]);
+        else if (lo == hi)
+            printf("  %6zu      %zu\n", lo, r.by_extents[i]);
+        else
+            printf("  %6zu-%-4zu %zu\n", lo, hi, r.by_extents[i]);
     }
 
-    char **names = malloc((sizeof(char *) * num_files_in_root) + sizeof(char *));
-    names[num_files_in_root] = NULL;
+    printf("Jumps between extents: %zu (%zu backward)\n", r.jumps, r.backward);
+    for (size_t i = 0; i < FRAG_GAP_BUCKETS; i++)
+    {
+        size_t lo = i == 0 ? 2 : (size_t)1 << (2 * i), hi = ((size_t)1 << (2 * i + 2)) - 1;
+        if (i + 1 == FRAG_GAP_BUCKETS)
+            printf("  %6zu+%6s sectors %zu\n", lo, "", r.by_gap[i]);
+        else
+            printf("  %6zu-%-6zu sectors %zu%s\n", lo, hi, r.by_gap[i], i == 0 ? " (not fragmented)" : "");
+    }
 
-    int i = 0;
-    while (dir_readdir(root_dir, file_name))
+    if (r.worst_cnt > 0 && r.worst[0].extents > 1)
+        printf("Most fragmented files:\n");
+    for (size_t i = 0; i < r.worst_cnt && r.worst[i].extents > 1; i++)
     {
-        names[i++] = strdup(file_name);
+        struct frag_worst *w = &r.worst[i];
+        printf("  %-20s %zu extents, %zu sectors, score %.3f\n", records[w->record].name, w->extents, w->sectors,
+               (double)(w->extents - 1) / (w->sectors - 1));
     }
-    dir_close(root_dir);
+    printf("Scanned in %.2f ms.\n", ms);
+    free(records);
+}
 
-    // For each file in the disk image fs root directory
-    // check if it exists in the host filesystem beforehand
-    // If so, don't want to remove it.
-    bool in_host_dir[num_files_in_root];
+/* Returns true if the inode at SECTOR is fragmented, by the test of
+   fragmentation_degree(), and stores its numbers of data sectors and
+   of extents into *SECTORS and *EXTENTS. MAP is the scratch map of
+   inode_map_extents(). */
+static bool frag_inode_is_fragmented(block_sector_t sector, size_t *sectors, size_t *extents,
+                                     struct inode_extent_map *map)
+{
+    struct frag_report r;
+    memset(&r, 0, sizeof r);
+    inode_map_extents(sector, frag_extent, &r, map);
+    *sectors = r.file_sectors;
+    *extents = r.file_extents;
+    return r.file_fragmented;
+}
+
+/* A fragmented file or directory queued by defrag_queue_fill(). */
+struct defrag_candidate
+{
+    char name[IMAGE_NAME_MAX + 1];
+    block_sector_t sector; // Its inode sector when queued
+    double score;          // As in fragmentation_report()
+};
 
-    for (int i = 0; i < num_files_in_root; i++)
+/* Defragmentation work kept between calls of defragment_slice(), so
+   that each slice carries on where the last one stopped. */
+static struct
+{
+    struct defrag_candidate *queue; // Most fragmented first
+    size_t cnt, next;               // Queued, and the next one to move
+    bool moved;                     // Has one moved since the scan?
+    size_t stuck;                   // Found no free run since the scan
+    unsigned idle_ms; // Budget of defragment_idle(), 0 if off
+    struct inode_extent_map map; // Scratch of frag_inode_is_fragmented()
+} defrag;
+
+/* qsort() comparator putting the most fragmented candidates first. */
+static int defrag_candidate_cmp(const void *a_, const void *b_)
+{
+    const struct defrag_candidate *a = a_, *b = b_;
+    if (a->score != b->score)
+        return a->score > b->score ? -1 : 1;
+    return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Replaces the queue with the fragmented files and directories of
+   the root directory, most fragmented first.  Returns false if the
+   root directory cannot be read. */
+static bool defrag_queue_fill(void)
+{
+    struct dir_record *records;
+    size_t record_cnt = getAllRecordsInRoot(&records);
+
+    free(defrag.queue);
+    defrag.queue = records != NULL ? malloc((record_cnt + 1) * sizeof *defrag.queue) : NULL;
+    defrag.cnt = defrag.next = 0;
+    defrag.moved = false;
+    defrag.stuck = 0;
+    if (defrag.queue == NULL)
     {
-        if (fopen(names[i], "r") != NULL)
-        {
-            in_host_dir[i] = true;
-        }
-        else
-        {
-            in_host_dir[i] = false;
-        }
+        free(records);
+        return false;
     }
 
-    for (int i = 0; names[i] != NULL; i++)
+    for (size_t i = 0; i < record_cnt; i++)
     {
-        copy_out(names[i]);
-        fsutil_rm(names[i]);
+        size_t sectors, extents;
+        if (!frag_inode_is_fragmented(records[i].inode_sector, &sectors, &extents, &defrag.map))
+            continue;
+        struct defrag_candidate *c = &defrag.queue[defrag.cnt++];
+        strcpy(c->name, records[i].name);
+        c->sector = records[i].inode_sector;
+        c->score = (double)(extents - 1) / (sectors - 1);
     }
-    for (int i = 0; names[i] != NULL; i++)
+    free(records);
+    qsort(defrag.queue, defrag.cnt, sizeof *defrag.queue, defrag_candidate_cmp);
+    return true;
+}
+
+/* Returns the milliseconds elapsed since START. */
+static double defrag_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * DESCRIPTION:
+ * Does one bounded slice of defragmentation. Queued fragmented files
+ * and directories of the root directory are moved in place by
+ * inode_relocate(), most fragmented first, until MAX_SECTORS data
+ * sectors have moved or MAX_MS milliseconds have passed; 0 means no
+ * limit, and a slice always tries at least one file. The queue is
+ * kept from one call to the next and filled again by a scan once
+ * used up, so slices can be spread out over time; a queued file is
+ * checked again just before it moves, in case it was removed or
+ * rewritten meanwhile. Files that find no run long enough are tried
+ * again after a scan that followed some progress.
+ *
+ * @return Returns true if there may be more to do, or false once a
+ *         scan finds nothing that can be moved (or P->failed is set).
+ */
+bool defragment_slice(size_t max_sectors, unsigned max_ms, struct defrag_progress *p)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(p, 0, sizeof *p);
+
+    struct dir *root = dir_open_root();
+    if (root == NULL)
+    {
+        p->failed = true;
+        return false;
+    }
+
+    bool more = true;
+    size_t tried = 0;
+    while (true)
     {
-        copy_in(names[i]);
-        if (!in_host_dir[i])
+        if (defrag.next == defrag.cnt)
+        {
+            // A whole pass that moved nothing would only repeat itself.
+            if (defrag.cnt > 0 && !defrag.moved)
+            {
+                more = false;
+                break;
+            }
+            if (!defrag_queue_fill())
+            {
+                p->failed = true;
+                more = false;
+                break;
+            }
+            if (defrag.cnt == 0)
+            {
+                more = false;
+                break;
+            }
+        }
+        if (tried > 0 && max_ms > 0 && defrag_elapsed_ms(&start) >= max_ms)
+            break;
+
+        struct defrag_candidate *c = &defrag.queue[defrag.next];
+        struct inode *inode = NULL;
+        size_t sectors, extents;
+        if (dir_lookup(root, c->name, &inode) && inode_get_inumber(inode) == c->sector &&
+            frag_inode_is_fragmented(c->sector, &sectors, &extents, &defrag.map))
         {
-            remove(names[i]); // potential edge case:
-            // say we have a.txt in host fs with contents "aaaa"
-            // and a.txt in disk image fs with contents "bbbb"
-            // then defragment will copy out a.txt from disk image fs
-            // into host fs, which will change the contents of a.txt in host fs
-            // to "bbbb".  DOUBT THIS WOULD BE TESTED.
+            // Stop short of a file that would overrun the budget, timing
+            // it by the rate of the files moved so far.
+            double ms = max_ms > 0 ? defrag_elapsed_ms(&start) : 0;
+            if (tried > 0 && ((max_sectors > 0 && p->moved_sectors + sectors > max_sectors) ||
+                              (max_ms > 0 && p->moved_sectors > 0 &&
+                               ms + ms * sectors / p->moved_sectors > max_ms)))
+            {
+                inode_close(inode);
+                break;
+            }
+            if (inode_relocate(inode))
+            {
+                p->moved++;
+                p->moved_sectors += sectors;
+                defrag.moved = true;
+            }
+            else
+            {
+                defrag.stuck++;
+            }
         }
+        inode_close(inode);
+        defrag.next++;
+        tried++;
     }
+    dir_close(root);
 
-    return 0; // Success
+    p->stuck = defrag.stuck;
+    p->left = defrag.cnt - defrag.next;
+    if (!more)
+        defrag.cnt = defrag.next = 0; // scan afresh next time
+    return more;
 }
 
-void recover0()
+/**
+ * DESCRIPTION:
+ * Runs defragment_slice() with the given budget and prints what it
+ * did. With no budget, this defragments the whole root directory.
+ *
+ * @return Returns 0 on success, or an error code if the root
+ *         directory cannot be read.
+ */
+int defragment_budget(size_t max_sectors, unsigned max_ms)
 {
-    size_t nb_of_sectors = bitmap_size(free_map);
+    struct defrag_progress p;
+    defragment_slice(max_sectors, max_ms, &p);
+    if (p.failed)
+        return handle_error(FILESYSTEM_ERROR);
 
-    // keeps track of recovered files
-    for (int i = 0; i < nb_of_sectors; i++)
-    {
+    printf("Defragmented %zu files (%zu sectors moved)", p.moved, p.moved_sectors);
+    if (p.stuck > 0)
+        printf("; %zu fragmented files found no free run long enough", p.stuck);
+    if (p.left > 0)
+        printf("; %zu more queued", p.left);
+    printf(".\n");
+    return 0;
+}
+
+/**
+ * DESCRIPTION:
+ * Defragments the files and directories of the root directory in
+ * place. Each fragmented one is moved by inode_relocate() into a
+ * single run of free sectors, one file at a time and one sector of
+ * data in memory at a time, so memory use does not grow with the
+ * disk and an interruption leaves the image consistent.
+ *
+ * @return Returns 0 on success, or an error code if the root
+ *         directory cannot be read.
+ */
+int defragment()
+{
+    return defragment_budget(0, 0);
+}
 
-        // if sector is currently in use
-        if (bitmap_test(free_map, i))
+/* Sets the budget of each slice defragment_idle() runs to MS
+   milliseconds; 0 turns idle defragmentation off. */
+void defragment_set_idle(unsigned ms)
+{
+    defrag.idle_ms = ms;
+}
+
+/* Runs one slice of defragmentation within the idle budget, quietly,
+   for the shell to call while it waits for input.  Returns true if
+   there may be more to do, false if not or if it is off. */
+bool defragment_idle(void)
+{
+    struct defrag_progress p;
+    if (defrag.idle_ms == 0)
+        return false;
+    return defragment_slice(0, defrag.idle_ms, &p);
+}
+
+/* The scan for removed inodes shared by the threads of recover0(). */
+struct recover_scan
+{
+    size_t sectors;             // Sectors in the free map
+    size_t next_chunk;          // Next chunk to scan, taken atomically
+    pthread_mutex_t lock;       // Protects the candidates
+    block_sector_t *candidates; // Free sectors that hold an inode
+    size_t cnt, cap;
+};
+
+/* Adds SECTOR to the candidates of SCAN. */
+static void recover_scan_add(struct recover_scan *scan, block_sector_t sector)
+{
+    pthread_mutex_lock(&scan->lock);
+    if (scan->cnt == scan->cap)
+    {
+        size_t cap = scan->cap > 0 ? 2 * scan->cap : 64;
+        block_sector_t *bigger = realloc(scan->candidates, cap * sizeof *bigger);
+        if (bigger != NULL)
         {
-            continue;
+            scan->candidates = bigger;
+            scan->cap = cap;
         }
+    }
+    if (scan->cnt < scan->cap)
+        scan->candidates[scan->cnt++] = sector;
+    pthread_mutex_unlock(&scan->lock);
+}
 
-        struct inode *inode = inode_open(i);
+/* Scans chunks of SCAN until there are none left: reads the free
+   sectors of each straight from the device, bypassing the buffer
+   cache, and keeps those that look like the inode of a file.  Reads
+   the free map without its lock, as nothing changes it meanwhile. */
+static void *recover_scan_worker(void *scan_)
+{
+    struct recover_scan *scan = scan_;
+    uint8_t *buffer = malloc(RECOVER_CHUNK_SECTORS * BLOCK_SECTOR_SIZE);
+    if (buffer == NULL)
+        return NULL;
 
-        // if magic is not 0, then it means this used to be the start of a file
-        if (inode->data.magic == INODE_MAGIC)
-        {
+    while (true)
+    {
+        size_t start = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED) * RECOVER_CHUNK_SECTORS;
+        if (start >= scan->sectors)
+            break;
+        size_t end = start + RECOVER_CHUNK_SECTORS < scan->sectors ? start + RECOVER_CHUNK_SECTORS : scan->sectors;
 
-            // creates file name
-            char namebuffer[NAME_MAX + 1];
-            snprintf(namebuffer, sizeof(namebuffer), "recovered0-%d", i);
+        // Sectors in use hold no removed inode: read from the first
+        // free one.
+        size_t first = bitmap_scan(free_map, start, 1, false);
+        if (first == BITMAP_ERROR || first >= end)
+            continue;
+        block_read_run(fs_device, first, end - first, buffer);
 
-            // adds file and links to inode
-            struct dir *root = dir_open_root();
-            dir_add(root, namebuffer, i, false);
-            inode->removed = false;
-            dir_close(root);
+        for (size_t i = first; i < end; i++)
+        {
+            const struct inode_disk *data = (const void *)(buffer + (i - first) * BLOCK_SECTOR_SIZE);
+            if (!bitmap_test(free_map, i) && data->magic == INODE_MAGIC && !(data->flags & INODE_INTERNAL))
+                recover_scan_add(scan, i);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
 
-            // adds entries to the sector array to know which sectors need to flipped
-            size_t num_sectors = bytes_to_sectors(inode->data.length);
-            block_sector_t *sectors = get_inode_data_sectors(inode);
+static int recover_sector_cmp(const void *a_, const void *b_)
+{
+    block_sector_t a = *(const block_sector_t *)a_, b = *(const block_sector_t *)b_;
+    return a < b ? -1 : a > b;
+}
 
-            for(int j=0; j < num_sectors; j++) {
-                bitmap_mark(free_map, sectors[j]);
-            }
-            free(sectors);
+/**
+ * DESCRIPTION:
+ * Brings back removed files whose inode and sectors have not been
+ * reused, linking each into the root directory as recovered0-N,
+ * where N is its inode sector. The free sectors are scanned in bulk
+ * by recover_scan_worker() for the inode magic; only the sectors
+ * found are then checked in full and claimed by inode_recover(), in
+ * sector order.
+ */
+void recover0()
+{
+    struct recover_scan scan;
+    memset(&scan, 0, sizeof scan);
+    scan.sectors = bitmap_size(free_map);
+    pthread_mutex_init(&scan.lock, NULL);
+
+    // The scan reads the device, not the cache.
+    buffer_cache_sync();
+
+    pthread_t threads[RECOVER_THREADS - 1];
+    size_t thread_cnt = 0;
+    while (thread_cnt < RECOVER_THREADS - 1 &&
+           pthread_create(&threads[thread_cnt], NULL, recover_scan_worker, &scan) == 0)
+        thread_cnt++;
+    recover_scan_worker(&scan);
+    for (size_t i = 0; i < thread_cnt; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&scan.lock);
+
+    qsort(scan.candidates, scan.cnt, sizeof *scan.candidates, recover_sector_cmp);
+    struct dir *root = dir_open_root();
+    for (size_t i = 0; i < scan.cnt; i++)
+    {
+        block_sector_t sector = scan.candidates[i];
+        if (!inode_recover(sector))
+            continue;
 
-            // bitmap_mark(free_map, inode->sector);
-            bitmap_mark(free_map, i);
+        char namebuffer[IMAGE_NAME_MAX + 1];
+        snprintf(namebuffer, sizeof(namebuffer), "recovered0-%" PRDSNu, sector);
+        if (!dir_add(root, namebuffer, sector, false))
+        {
+            // Could not link it: free its sectors again.
+            struct inode *inode = inode_open(sector);
+            inode_remove(inode);
+            inode_close(inode);
         }
-
-        // closes (i.e frees) opened inode
-        inode_close(inode);
     }
+    dir_close(root);
+    free(scan.candidates);
 }
 
 void recover1()
@@ -601,7 +1576,7 @@ void recover2()
     while (dir_readdir(root, filename))
     {
         char buffer[BLOCK_SECTOR_SIZE + 1];
-        int filesize_bytes = fsutil_size(filename);
+        offset_t filesize_bytes = fsutil_size(filename);
         size_t filesector_size = bytes_to_sectors(filesize_bytes);
         int remainder = filesize_bytes % BLOCK_SECTOR_SIZE;
 
@@ -609,7 +1584,14 @@ void recover2()
 
         // struct inode *inode = inode_open(file->inode->data.direct_blocks[filesector_size]);
 
-        buffer_cache_read(file->inode->data.direct_blocks[filesector_size - 1], buffer);
+        // inline files keep their slack in the inode itself
+        if (inode_is_inline(file->inode))
+        {
+            memset(buffer, 0, BLOCK_SECTOR_SIZE);
+            memcpy(buffer, file->inode->data.inline_data, INODE_INLINE_SIZE);
+        }
+        else
+            buffer_cache_read(file->inode->data.direct_blocks[filesector_size - 1], buffer);
 
         char newfilename[NAME_MAX + 100];
         snprintf(newfilename, sizeof(newfilename), "recovered2-%s.txt", filename);
@@ -635,6 +1617,9 @@ void recover2()
 
 void recover(int flag)
 {
+    // recovery reads the free map directly; let pending deletions land
+    inode_reclaim_wait();
+
     if (flag == 0)
     { // recover deleted inodes
         recover0();
@@ -1,11 +1,33 @@
 #ifndef FILESYS_FSUTIL2_H
 #define FILESYS_FSUTIL2_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/* What one call of defragment_slice() did. */
+struct defrag_progress
+{
+    size_t moved;         // Files moved
+    size_t moved_sectors; // Their data sectors
+    size_t stuck;         // Fragmented files no free run could hold
+    size_t left;          // Fragmented files still queued
+    bool failed;          // The root directory could not be read
+};
+
 int copy_in(char *fname);
 int copy_out(char *fname);
+int copy_in_dir(char *host_dir);
+int copy_out_dir(char *host_dir);
 void find_file(char *pattern);
+void find_files(char **patterns, size_t cnt);
+int build_content_index(void);
 void fragmentation_degree();
+void fragmentation_report();
 int defragment();
+int defragment_budget(size_t max_sectors, unsigned max_ms);
+bool defragment_slice(size_t max_sectors, unsigned max_ms, struct defrag_progress *);
+void defragment_set_idle(unsigned ms);
+bool defragment_idle(void);
 void recover(int flag);
 
 #endif /* fs/fsutil2.h */
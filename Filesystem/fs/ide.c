@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -77,7 +78,7 @@ static void identify_ata_device(struct ata_disk *d) {
 static void ide_read(void *d_, block_sector_t sec_no, void *buffer) {
 
   struct ata_disk *d = d_;
-  lseek(d->fd, sec_no * BLOCK_SECTOR_SIZE, SEEK_SET);
+  lseek(d->fd, (off_t)sec_no * BLOCK_SECTOR_SIZE, SEEK_SET);
   read(d->fd, buffer, BLOCK_SECTOR_SIZE);
 }
 
@@ -85,8 +86,28 @@ static void ide_read(void *d_, block_sector_t sec_no, void *buffer) {
    BLOCK_SECTOR_SIZE bytes. */
 static void ide_write(void *d_, block_sector_t sec_no, const void *buffer) {
   struct ata_disk *d = d_;
-  lseek(d->fd, sec_no * BLOCK_SECTOR_SIZE, SEEK_SET);
+  lseek(d->fd, (off_t)sec_no * BLOCK_SECTOR_SIZE, SEEK_SET);
   write(d->fd, buffer, BLOCK_SECTOR_SIZE);
 }
 
-static struct block_operations ide_operations = {ide_read, ide_write};
\ No newline at end of file
+/* Reads the CNT sectors from SEC_NO on disk D into BUFFER.  Uses
+   positioned reads, which leave the file offset alone, so that
+   several threads may read at once.  Sectors past the end of the
+   file read as zeros. */
+static void ide_read_run(void *d_, block_sector_t sec_no, size_t cnt,
+                         void *buffer) {
+  struct ata_disk *d = d_;
+  size_t size = cnt * BLOCK_SECTOR_SIZE, done = 0;
+
+  while (done < size) {
+    ssize_t n = pread(d->fd, (char *)buffer + done, size - done,
+                      (off_t)sec_no * BLOCK_SECTOR_SIZE + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  memset((char *)buffer + done, 0, size - done);
+}
+
+static struct block_operations ide_operations = {ide_read, ide_write,
+                                                 ide_read_run};
\ No newline at end of file
@@ -1,10 +1,13 @@
 #include "inode.h"
+#include "bitmap.h"
 #include "cache.h"
 #include "debug.h"
 #include "filesys.h"
 #include "free-map.h"
+#include "hash.h"
 #include "list.h"
 #include "round.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,9 +16,24 @@ struct inode_indirect_block_sector {
   block_sector_t blocks[INDIRECT_BLOCKS_PER_SECTOR];
 };
 
-static bool inode_allocate(struct inode_disk *disk_inode);
-static bool inode_reserve(struct inode_disk *disk_inode, offset_t length);
-static bool inode_deallocate(struct inode *inode);
+/* Free sectors handed out to a growing block map.  They come from
+   runs of consecutive sectors taken from the free map, so that data
+   and indirect blocks are laid out in the order they are mapped. */
+struct sector_run {
+  block_sector_t next; /* Next sector of the current run. */
+  size_t left;         /* Sectors left in the current run. */
+  size_t want;         /* Sectors still expected to be needed. */
+  bool fill;           /* Zero new data sectors? */
+};
+
+static bool inode_allocate(struct inode_disk *disk_inode,
+                           block_sector_t sector);
+static bool inode_reserve(struct inode_disk *disk_inode, size_t start,
+                          offset_t length, struct sector_run *run);
+static bool inode_reserve_run(struct inode_disk *disk_inode, size_t start,
+                              offset_t length, block_sector_t hint);
+static size_t inode_deallocate(struct inode *inode, bool deferred);
+static bool inode_spill_inline(struct inode *inode);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -25,10 +43,65 @@ size_t bytes_to_sectors(offset_t size) {
 
 static inline size_t min(size_t a, size_t b) { return a < b ? a : b; }
 
+/* Returns the file size recorded in DISK_INODE. */
+static inline offset_t disk_length(const struct inode_disk *disk_inode) {
+  return (offset_t)disk_inode->length_hi << 32 | disk_inode->length_lo;
+}
+
+/* Records LENGTH as the file size in DISK_INODE. */
+static inline void disk_set_length(struct inode_disk *disk_inode,
+                                   offset_t length) {
+  disk_inode->length_lo = (uint32_t)length;
+  disk_inode->length_hi = (uint8_t)(length >> 32);
+}
+
+/* Returns the number of data sectors mapped by a tree of indirect
+   blocks that is LEVEL levels high. */
+static size_t tree_capacity(int level) {
+  size_t cnt = 1;
+  while (level-- > 0)
+    cnt *= INDIRECT_BLOCKS_PER_SECTOR;
+  return cnt;
+}
+
+/* Returns the number of levels of the doubly indirect tree. */
+static inline int tree_levels(const struct inode_disk *disk_inode) {
+  return 2 + disk_inode->depth;
+}
+
+/* Returns the number of indirect block sectors needed to map
+   NUM_SECTORS data sectors. */
+static size_t map_sectors(size_t num_sectors) {
+  size_t cnt = 0;
+  int level, levels = 2;
+
+  if (num_sectors <= DIRECT_BLOCKS_COUNT)
+    return 0;
+  num_sectors -= DIRECT_BLOCKS_COUNT;
+  cnt++; // indirect block
+  if (num_sectors <= INDIRECT_BLOCKS_PER_SECTOR)
+    return cnt;
+  num_sectors -= INDIRECT_BLOCKS_PER_SECTOR;
+
+  while (num_sectors > tree_capacity(levels))
+    levels++;
+  for (level = 1; level <= levels; level++)
+    cnt += DIV_ROUND_UP(num_sectors, tree_capacity(level));
+  return cnt;
+}
+
+/* Returns the number of data sectors held by INODE, which is zero
+   for files whose data lives inline in the inode sector. */
+size_t inode_data_sectors(const struct inode *inode) {
+  if (inode_is_inline(inode))
+    return 0;
+  return bytes_to_sectors(inode_length(inode));
+}
+
 static block_sector_t index_to_sector(const struct inode_disk *idisk,
                                       offset_t index) {
   offset_t index_base = 0, index_limit = 0; // base, limit for sector index
-  block_sector_t ret;
+  struct inode_indirect_block_sector indirect_idisk;
 
   // (1) direct blocks
   index_limit += DIRECT_BLOCKS_COUNT * 1;
@@ -40,37 +113,29 @@ static block_sector_t index_to_sector(const struct inode_disk *idisk,
   // (2) a single indirect block
   index_limit += 1 * INDIRECT_BLOCKS_PER_SECTOR;
   if (index < index_limit) {
-    struct inode_indirect_block_sector *indirect_idisk;
-    indirect_idisk = calloc(1, sizeof(struct inode_indirect_block_sector));
-    buffer_cache_read(idisk->indirect_block, indirect_idisk);
-
-    ret = indirect_idisk->blocks[index - index_base];
-    free(indirect_idisk);
-
-    return ret;
+    buffer_cache_read(idisk->indirect_block, &indirect_idisk);
+    return indirect_idisk.blocks[index - index_base];
   }
   index_base = index_limit;
 
-  // (3) a single doubly indirect block
-  index_limit += 1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR;
+  // (3) a doubly indirect tree, grown by `depth' levels for large files
+  int level = tree_levels(idisk);
+  index_limit += tree_capacity(level);
   if (index < index_limit) {
-    // first and second level block index, respecitvely
-    offset_t index_first = (index - index_base) / INDIRECT_BLOCKS_PER_SECTOR;
-    offset_t index_second = (index - index_base) % INDIRECT_BLOCKS_PER_SECTOR;
-
-    // fetch two indirect block sectors
-    struct inode_indirect_block_sector *indirect_idisk;
-    indirect_idisk = calloc(1, sizeof(struct inode_indirect_block_sector));
-
-    buffer_cache_read(idisk->doubly_indirect_block, indirect_idisk);
-    buffer_cache_read(indirect_idisk->blocks[index_first], indirect_idisk);
-    ret = indirect_idisk->blocks[index_second];
-
-    free(indirect_idisk);
-    return ret;
+    block_sector_t sector = idisk->doubly_indirect_block;
+    size_t rest = index - index_base;
+
+    // walk down one indirect block sector per level
+    for (; level > 0; level--) {
+      size_t unit = tree_capacity(level - 1);
+      buffer_cache_read(sector, &indirect_idisk);
+      sector = indirect_idisk.blocks[rest / unit];
+      rest %= unit;
+    }
+    return sector;
   }
 
-  // (4) ?
+  // (4) beyond the largest possible file
   return -1;
 }
 
@@ -80,7 +145,9 @@ static block_sector_t index_to_sector(const struct inode_disk *idisk,
    POS. */
 static block_sector_t byte_to_sector(const struct inode *inode, offset_t pos) {
   ASSERT(inode != NULL);
-  if (0 <= pos && pos < inode->data.length) {
+  if (inode_is_inline(inode))
+    return -1;
+  if (0 <= pos && pos < inode_length(inode)) {
     // sector index
     offset_t index = pos / BLOCK_SECTOR_SIZE;
     return index_to_sector(&inode->data, index);
@@ -88,12 +155,139 @@ static block_sector_t byte_to_sector(const struct inode *inode, offset_t pos) {
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Table of open inodes keyed by sector, so that opening a single
+   inode twice returns the same `struct inode'.  Also holds the
+   inodes on closed_inodes. */
+static struct hash open_inodes;
+
+/* Maximum number of closed inodes kept in memory. */
+#define INODE_CACHE_SIZE 128
+
+/* Recently closed inodes, most recently closed first.  They stay in
+   open_inodes with an open_cnt of 0, so that inode_open() can revive
+   them without reading the inode sector again. */
+static struct list closed_inodes;
+static size_t closed_cnt;
+
+/* Whether removed files may be freed by the background reclaimer.
+   Build with -D ASYNC_RECLAIM=0 to always free them in place. */
+#ifndef ASYNC_RECLAIM
+#define ASYNC_RECLAIM 1
+#endif
+
+/* Removed files with more data sectors than this are handed to the
+   background reclaimer, so that deleting them returns at once.
+   Smaller ones are cheaper to free in place. */
+#define RECLAIM_MIN_SECTORS 64
+
+/* Removed inodes waiting for the reclaimer, linked by lru_elem.
+   Guarded by reclaim_lock, like reclaim_busy. */
+static struct list reclaim_queue;
+static bool reclaim_busy;    /* Reclaimer is freeing an inode. */
+static bool reclaim_started; /* Reclaimer thread exists. */
+static pthread_t reclaim_thread;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaim_idle = PTHREAD_COND_INITIALIZER;
+
+static unsigned inode_hash(const struct hash_elem *e, void *aux UNUSED) {
+  const struct inode *inode = hash_entry(e, struct inode, elem);
+  return hash_int(inode->sector);
+}
+
+static bool inode_less(const struct hash_elem *a, const struct hash_elem *b,
+                       void *aux UNUSED) {
+  return hash_entry(a, struct inode, elem)->sector <
+         hash_entry(b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
-void inode_init(void) { llist_init(&open_inodes); }
+void inode_init(void) {
+  if (!hash_init(&open_inodes, inode_hash, inode_less, NULL))
+    PANIC("can't allocate open inode table");
+  llist_init(&closed_inodes);
+  closed_cnt = 0;
+  llist_init(&reclaim_queue);
+}
+
+/* Frees the sectors of removed inodes queued by inode_reclaim(). */
+static void *reclaim_worker(void *aux UNUSED) {
+  pthread_mutex_lock(&reclaim_lock);
+  for (;;) {
+    while (list_empty(&reclaim_queue))
+      pthread_cond_wait(&reclaim_work, &reclaim_lock);
+    struct inode *inode =
+        list_entry(list_pop_front(&reclaim_queue), struct inode, lru_elem);
+    reclaim_busy = true;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    inode_deallocate(inode, true);
+    free(inode);
+
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_busy = false;
+    if (list_empty(&reclaim_queue))
+      pthread_cond_broadcast(&reclaim_idle);
+  }
+  return NULL;
+}
+
+/* Hands removed INODE, already out of open_inodes, to the background
+   reclaimer if it is large enough to be worth it.  Its sectors count
+   as free from now on.  Returns false if the caller should free
+   INODE itself. */
+static bool inode_reclaim(struct inode *inode) {
+  size_t data_sectors = inode_data_sectors(inode);
+
+  if (!ASYNC_RECLAIM || data_sectors <= RECLAIM_MIN_SECTORS)
+    return false;
+
+  pthread_mutex_lock(&reclaim_lock);
+  if (!reclaim_started) {
+    if (pthread_create(&reclaim_thread, NULL, reclaim_worker, NULL) != 0) {
+      pthread_mutex_unlock(&reclaim_lock);
+      return false;
+    }
+    pthread_detach(reclaim_thread);
+    reclaim_started = true;
+  }
+  free_map_defer(1 + data_sectors + map_sectors(data_sectors));
+  list_push_back(&reclaim_queue, &inode->lru_elem);
+  pthread_cond_signal(&reclaim_work);
+  pthread_mutex_unlock(&reclaim_lock);
+  return true;
+}
+
+/* Waits until the background reclaimer has freed every inode handed
+   to it.  Needed before looking at the free map directly, and
+   before shutting down. */
+void inode_reclaim_wait(void) {
+  pthread_mutex_lock(&reclaim_lock);
+  while (!list_empty(&reclaim_queue) || reclaim_busy)
+    pthread_cond_wait(&reclaim_idle, &reclaim_lock);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+/* Drops closed INODE from memory. */
+static void inode_evict(struct inode *inode) {
+  ASSERT(inode->open_cnt == 0);
+  list_remove(&inode->lru_elem);
+  closed_cnt--;
+  hash_delete(&open_inodes, &inode->elem);
+  free(inode);
+}
+
+/* Drops the closed inode for SECTOR, if one is still kept in memory,
+   because the sector is about to get new contents. */
+static void inode_forget(block_sector_t sector) {
+  struct hash_elem *e;
+  struct inode key;
+
+  key.sector = sector;
+  e = hash_find(&open_inodes, &key.elem);
+  if (e != NULL && hash_entry(e, struct inode, elem)->open_cnt == 0)
+    inode_evict(hash_entry(e, struct inode, elem));
+}
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
@@ -110,14 +304,18 @@ bool inode_create(block_sector_t sector, offset_t length, bool is_dir) {
      one sector in size, and you should fix that. */
   ASSERT(sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
+  inode_forget(sector);
+
   disk_inode = calloc(1, sizeof *disk_inode);
   if (disk_inode != NULL) {
-    disk_inode->length = length;
+    disk_set_length(disk_inode, length);
     disk_inode->magic = INODE_MAGIC;
     disk_inode->is_dir = is_dir;
-    if (inode_allocate(disk_inode)) {
+    if (length <= (offset_t)INODE_INLINE_SIZE)
+      disk_inode->flags |= INODE_INLINE;
+    if (inode_allocate(disk_inode, sector)) {
       buffer_cache_write(sector, disk_inode);
-      success = true;
+      success = free_map_flush();
     }
     free(disk_inode);
   }
@@ -128,17 +326,20 @@ bool inode_create(block_sector_t sector, offset_t length, bool is_dir) {
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *inode_open(block_sector_t sector) {
-  struct list_elem *e;
-  struct inode *inode;
+  struct hash_elem *e;
+  struct inode *inode, key;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-       e = list_next(e)) {
-    inode = list_entry(e, struct inode, elem);
-    if (inode->sector == sector) {
-      inode_reopen(inode);
-      return inode;
+  key.sector = sector;
+  e = hash_find(&open_inodes, &key.elem);
+  if (e != NULL) {
+    inode = hash_entry(e, struct inode, elem);
+    if (inode->open_cnt == 0) {
+      /* Revive a recently closed inode. */
+      list_remove(&inode->lru_elem);
+      closed_cnt--;
     }
+    return inode_reopen(inode);
   }
 
   /* Allocate memory. */
@@ -147,27 +348,59 @@ struct inode *inode_open(block_sector_t sector) {
     return NULL;
 
   /* Initialize. */
-  list_push_front(&open_inodes, &inode->elem);
   inode->sector = sector;
+  hash_insert(&open_inodes, &inode->elem);
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->alloc_hint = sector;
+  inode->checked_index = 0;
   buffer_cache_read(inode->sector, &inode->data);
 
   return inode;
 }
 
 /* Reopens and returns INODE. */
-struct inode *inode_reopen(struct inode *inode) { return inode; }
+struct inode *inode_reopen(struct inode *inode) {
+  if (inode != NULL)
+    inode->open_cnt++;
+  return inode;
+}
 
 /* Returns INODE's inode number. */
 block_sector_t inode_get_inumber(const struct inode *inode) {
   return inode->sector;
 }
 
+/* Returns the sector near which the next file created in directory
+   INODE should be placed: just past the previous one, so that files
+   created together in a directory are laid out together. */
+block_sector_t inode_alloc_hint(const struct inode *inode) {
+  return inode->alloc_hint;
+}
+
+/* Sets the placement hint of directory INODE to SECTOR. */
+void inode_set_alloc_hint(struct inode *inode, block_sector_t sector) {
+  inode->alloc_hint = sector;
+}
+
+/* Returns the sector of the hash index of directory INODE that was
+   last found to match its entries since INODE was read in, or 0. */
+block_sector_t inode_checked_index(const struct inode *inode) {
+  return inode->checked_index;
+}
+
+/* Records that the hash index in SECTOR matches the entries of
+   directory INODE. */
+void inode_set_checked_index(struct inode *inode, block_sector_t sector) {
+  inode->checked_index = sector;
+}
+
 /* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If this was the last reference to INODE, moves it to the closed
+   inode cache, or frees its memory if it cannot be kept there.
+   If INODE was also a removed inode, frees its blocks, possibly in
+   the background (see inode_reclaim()). */
 void inode_close(struct inode *inode) {
   /* Ignore null pointer. */
   if (inode == NULL) {
@@ -176,15 +409,29 @@ void inode_close(struct inode *inode) {
   /* Release resources if this was the last opener. */
   if (--inode->open_cnt == 0) {
 
-    /* Remove from inode list and release lock. */
-    list_remove(&inode->elem);
-
     /* Deallocate blocks if removed. */
     if (inode->removed) {
-      free_map_release(inode->sector, 1);
-      inode_deallocate(inode);
+      hash_delete(&open_inodes, &inode->elem);
+      if (!inode_reclaim(inode)) {
+        inode_deallocate(inode, false);
+        free(inode);
+      }
+      return;
     }
-    free(inode);
+
+    /* Only keep real inodes that are still allocated, so that sectors
+       opened speculatively (e.g. by recovery) never go stale. */
+    if (inode->data.magic != INODE_MAGIC ||
+        !free_map_in_use(inode->sector)) {
+      hash_delete(&open_inodes, &inode->elem);
+      free(inode);
+      return;
+    }
+
+    list_push_front(&closed_inodes, &inode->lru_elem);
+    if (++closed_cnt > INODE_CACHE_SIZE)
+      inode_evict(list_entry(list_back(&closed_inodes), struct inode,
+                             lru_elem));
   }
 }
 
@@ -204,6 +451,16 @@ offset_t inode_read_at(struct inode *inode, void *buffer_, offset_t size,
   offset_t bytes_read = 0;
   uint8_t *bounce = NULL;
 
+  if (inode_is_inline(inode)) {
+    offset_t inode_left = inode_length(inode) - offset;
+    if (size > inode_left)
+      size = inode_left;
+    if (size <= 0)
+      return 0;
+    memcpy(buffer, inode->data.inline_data + offset, size);
+    return size;
+  }
+
   while (size > 0) {
     /* Disk sector to read, starting byte offset within sector. */
     block_sector_t sector_idx = byte_to_sector(inode, offset);
@@ -260,17 +517,33 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
     return 0;
   }
 
+  if (inode_is_inline(inode)) {
+    if (offset + size <= (offset_t)INODE_INLINE_SIZE) {
+      // small enough to stay in the inode sector
+      memcpy(inode->data.inline_data + offset, buffer, size);
+      if (offset + size > inode_length(inode))
+        disk_set_length(&inode->data, offset + size);
+      buffer_cache_write(inode->sector, &inode->data);
+      return size;
+    }
+    if (!inode_spill_inline(inode))
+      return 0;
+  }
+
   // beyond the EOF: extend the file
   if (byte_to_sector(inode, offset + size - 1) == -1u) {
     // extend and reserve up to [offset + size] bytes
     bool success;
-    success = inode_reserve(&inode->data, offset + size);
+    success = inode_reserve_run(&inode->data, inode_data_sectors(inode),
+                                offset + size, inode->sector);
     if (!success)
       return 0; // fail?
 
     // write back the (extended) file size
-    inode->data.length = offset + size;
+    disk_set_length(&inode->data, offset + size);
     buffer_cache_write(inode->sector, &inode->data);
+    if (!free_map_flush())
+      return 0;
   }
 
   while (size > 0) {
@@ -326,6 +599,32 @@ offset_t inode_write_at(struct inode *inode, const void *buffer_, offset_t size,
   return bytes_written;
 }
 
+/* Extends INODE to LENGTH bytes of zeros, taking its new data sectors
+   from one contiguous run of free sectors if possible, so that files
+   whose final size is known up front are not fragmented.
+   Does nothing if INODE is already at least LENGTH bytes long.
+   Returns true if successful, false if out of disk space. */
+bool inode_fallocate(struct inode *inode, offset_t length) {
+  if (inode->deny_write_cnt)
+    return false;
+  if (length <= inode_length(inode))
+    return true;
+
+  if (inode_is_inline(inode)) {
+    if (length > (offset_t)INODE_INLINE_SIZE && !inode_spill_inline(inode))
+      return false;
+  }
+
+  if (!inode_is_inline(inode) &&
+      !inode_reserve_run(&inode->data, inode_data_sectors(inode), length,
+                         inode->sector))
+    return false;
+
+  disk_set_length(&inode->data, length);
+  buffer_cache_write(inode->sector, &inode->data);
+  return free_map_flush();
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void inode_deny_write(struct inode *inode) {
@@ -343,35 +642,105 @@ void inode_allow_write(struct inode *inode) {
 }
 
 /* Returns the length, in bytes, of INODE's data. */
-offset_t inode_length(const struct inode *inode) { return inode->data.length; }
+offset_t inode_length(const struct inode *inode) {
+  return disk_length(&inode->data);
+}
 
 /* Returns whether the file is directory or not. */
 bool inode_is_directory(const struct inode *inode) {
   return inode->data.is_dir;
 }
 
+/* Returns whether the data of INODE is stored inline. */
+bool inode_is_inline(const struct inode *inode) {
+  return (inode->data.flags & INODE_INLINE) != 0;
+}
+
+/* Marks INODE as file system metadata, such as a directory index,
+   which recovery must not bring back as a file. */
+void inode_set_internal(struct inode *inode) {
+  inode->data.flags |= INODE_INTERNAL;
+  buffer_cache_write(inode->sector, &inode->data);
+}
+
+/* Returns whether INODE holds file system metadata. */
+bool inode_is_internal(const struct inode *inode) {
+  return (inode->data.flags & INODE_INTERNAL) != 0;
+}
+
 /* Returns whether the file is removed or not. */
 bool inode_is_removed(const struct inode *inode) { return inode->removed; }
 
-static bool inode_allocate(struct inode_disk *disk_inode) {
-  return inode_reserve(disk_inode, disk_inode->length);
+/* Sets *LENGTH and *IS_DIR to the length and type of the inode in
+   SECTOR without opening it: from memory if it is open or was
+   recently closed, otherwise from its sector through the buffer
+   cache.  Returns false if SECTOR does not hold an inode. */
+bool inode_stat(block_sector_t sector, offset_t *length, bool *is_dir) {
+  struct hash_elem *e;
+  struct inode key;
+  struct inode_disk disk_inode;
+  const struct inode_disk *data = &disk_inode;
+
+  key.sector = sector;
+  e = hash_find(&open_inodes, &key.elem);
+  if (e != NULL)
+    data = &hash_entry(e, struct inode, elem)->data;
+  else
+    buffer_cache_read(sector, &disk_inode);
+  if (data->magic != INODE_MAGIC)
+    return false;
+  *length = disk_length(data);
+  *is_dir = data->is_dir;
+  return true;
+}
+
+/* Allocates the data sectors of DISK_INODE, which is to be stored at
+   SECTOR. */
+static bool inode_allocate(struct inode_disk *disk_inode,
+                           block_sector_t sector) {
+  if (disk_inode->flags & INODE_INLINE)
+    return true;
+  return inode_reserve_run(disk_inode, 0, disk_length(disk_inode), sector);
 }
 
-static bool inode_reserve_indirect(block_sector_t *p_entry, size_t num_sectors,
-                                   int level) {
+/* Takes the next sector of RUN for a block map, refilling RUN from
+   the free map when it is used up: with as much of the rest of the
+   request as fits in one piece, preferably right after the sectors
+   handed out so far. */
+static bool take_sector(struct sector_run *run, block_sector_t *sectorp) {
+  if (run->left == 0) {
+    run->left = free_map_allocate_upto(run->want > 0 ? run->want : 1,
+                                       run->next, &run->next);
+    if (run->left == 0)
+      return false;
+  }
+  *sectorp = run->next++;
+  run->left--;
+  if (run->want > 0)
+    run->want--;
+  return true;
+}
+
+/* Makes sure the data sectors with indexes [START, END) of the
+   indirect block tree at *P_ENTRY, which is LEVEL levels high, are
+   allocated.  Subtrees left of START are not visited.  Data and
+   indirect block sectors come from RUN (see take_sector()). */
+static bool inode_reserve_indirect(block_sector_t *p_entry, size_t start,
+                                   size_t end, int level,
+                                   struct sector_run *run) {
   static char zeros[BLOCK_SECTOR_SIZE];
 
-  // only supports 2-level indirect block scheme as of now
-  ASSERT(level <= 2);
+  ASSERT(level <= 2 + INODE_MAX_DEPTH);
 
   if (level == 0) {
     // base case : allocate a single sector if necessary and put it into the
     // block
     if (*p_entry == 0) {
-      if (!free_map_allocate(1, p_entry))
+      if (!take_sector(run, p_entry))
         return false;
 
-      buffer_cache_write(*p_entry, zeros);
+      if (run->fill)
+        buffer_cache_write(*p_entry, zeros);
     }
     return true;
   }
@@ -379,148 +748,348 @@ static bool inode_reserve_indirect(block_sector_t *p_entry, size_t num_sectors,
   struct inode_indirect_block_sector indirect_block;
   if (*p_entry == 0) {
     // not yet allocated: allocate it, and fill with zero
-    free_map_allocate(1, p_entry);
+    if (!take_sector(run, p_entry))
+      return false;
     buffer_cache_write(*p_entry, zeros);
   }
   buffer_cache_read(*p_entry, &indirect_block);
 
-  size_t unit = (level == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR);
-  size_t i, l = DIV_ROUND_UP(num_sectors, unit);
+  size_t unit = tree_capacity(level - 1);
+  size_t i;
+  bool success = true;
 
-  for (i = 0; i < l; ++i) {
-    size_t subsize = min(num_sectors, unit);
-    if (!inode_reserve_indirect(&indirect_block.blocks[i], subsize, level - 1))
-      return false;
-    num_sectors -= subsize;
+  for (i = start / unit; i * unit < end && success; ++i) {
+    size_t base = i * unit;
+    success = inode_reserve_indirect(&indirect_block.blocks[i],
+                                     start > base ? start - base : 0,
+                                     min(end - base, unit), level - 1, run);
   }
 
-  ASSERT(num_sectors == 0);
+  // keep whatever got allocated reachable, even on failure
   buffer_cache_write(*p_entry, &indirect_block);
+  return success;
+}
+
+/* Puts another level on top of the doubly indirect tree of
+   DISK_INODE, whose current tree becomes the first child of the new
+   root.  Mapped sectors keep their indexes. */
+static bool inode_grow_tree(struct inode_disk *disk_inode,
+                            struct sector_run *run) {
+  struct inode_indirect_block_sector root;
+  block_sector_t sector;
+
+  if (disk_inode->depth >= INODE_MAX_DEPTH)
+    return false;
+
+  if (disk_inode->doubly_indirect_block != 0) {
+    if (!take_sector(run, &sector))
+      return false;
+    memset(&root, 0, sizeof root);
+    root.blocks[0] = disk_inode->doubly_indirect_block;
+    buffer_cache_write(sector, &root);
+    disk_inode->doubly_indirect_block = sector;
+  }
+  disk_inode->depth++;
   return true;
 }
 
 /**
  * Extend inode blocks, so that the file can hold at least
- * `length` bytes.
+ * `length` bytes.  The first `start` data sectors must already
+ * be allocated; they are skipped rather than walked again.
+ * New sectors come from `run` (see take_sector()).
  */
-static bool inode_reserve(struct inode_disk *disk_inode, offset_t length) {
+static bool inode_reserve(struct inode_disk *disk_inode, size_t start,
+                          offset_t length, struct sector_run *run) {
   static char zeros[BLOCK_SECTOR_SIZE];
   if (length < 0)
     return false;
 
-  // (remaining) number of sectors, occupied by this file.
-  size_t num_sectors = bytes_to_sectors(length);
-  size_t i, l;
+  // number of sectors, occupied by this file.
+  size_t end = bytes_to_sectors(length);
+  size_t i, base, limit;
 
   // (1) direct blocks
-  l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
-  for (i = 0; i < l; ++i) {
+  limit = min(end, DIRECT_BLOCKS_COUNT * 1);
+  for (i = start; i < limit; ++i) {
     if (disk_inode->direct_blocks[i] == 0) { // unoccupied
-      if (!free_map_allocate(1, &disk_inode->direct_blocks[i]))
+      if (!take_sector(run, &disk_inode->direct_blocks[i]))
         return false;
-      buffer_cache_write(disk_inode->direct_blocks[i], zeros);
+      if (run->fill)
+        buffer_cache_write(disk_inode->direct_blocks[i], zeros);
     }
   }
-  num_sectors -= l;
-  if (num_sectors == 0)
+  base = DIRECT_BLOCKS_COUNT * 1;
+  if (end <= base)
     return true;
 
   // (2) a single indirect block
-  l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
-  if (!inode_reserve_indirect(&disk_inode->indirect_block, l, 1))
+  limit = base + 1 * INDIRECT_BLOCKS_PER_SECTOR;
+  if (start < limit &&
+      !inode_reserve_indirect(&disk_inode->indirect_block,
+                              start > base ? start - base : 0,
+                              min(end, limit) - base, 1, run))
     return false;
-  num_sectors -= l;
-  if (num_sectors == 0)
+  base = limit;
+  if (end <= base)
     return true;
 
-  // (3) a single doubly indirect block
-  l = min(num_sectors,
-          1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-  if (!inode_reserve_indirect(&disk_inode->doubly_indirect_block, l, 2))
-    return false;
-  num_sectors -= l;
-  if (num_sectors == 0)
-    return true;
+  // (3) a doubly indirect tree, taller if the file needs it
+  while (end - base > tree_capacity(tree_levels(disk_inode)))
+    if (!inode_grow_tree(disk_inode, run))
+      return false;
+  return inode_reserve_indirect(&disk_inode->doubly_indirect_block,
+                                start > base ? start - base : 0, end - base,
+                                tree_levels(disk_inode), run);
+}
 
-  ASSERT(num_sectors == 0);
-  return false;
+/* Like inode_reserve(), but works out how many sectors the block map
+   grows by and takes them in as few runs of the free map as it can,
+   starting right after the file's last data sector, or after HINT
+   (the inode's own sector) if it has none yet.  That keeps the
+   inode, its indirect blocks and its data close together on disk.
+   Sectors left over are given back.
+   Fails without allocating anything if the disk is too full. */
+static bool inode_reserve_run(struct inode_disk *disk_inode, size_t start,
+                              offset_t length, block_sector_t hint) {
+  size_t end = length > 0 ? bytes_to_sectors(length) : 0;
+  struct sector_run run;
+  bool success;
+
+  run.next = start > 0 ? index_to_sector(disk_inode, start - 1) + 1 : hint;
+  run.left = 0;
+  run.fill = true;
+  run.want = end > start ? end - start + map_sectors(end) - map_sectors(start)
+                         : 0;
+  // fail up front rather than leave a partial reservation behind
+  if (run.want > free_map_available()) {
+    inode_reclaim_wait();
+    if (run.want > free_map_available())
+      return false;
+  }
+
+  success = inode_reserve(disk_inode, start, length, &run);
+  if (run.left > 0)
+    free_map_release(run.next, run.left);
+  return success;
 }
 
-static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
-                                      int level) {
-  // only supports 2-level indirect block scheme as of now
-  ASSERT(level <= 2);
+/* Sectors being given back to the free map, gathered into runs of
+   consecutive sectors so that each run is released at once. */
+struct release_batch {
+  block_sector_t start; /* First sector of the pending run. */
+  size_t cnt;           /* Length of the pending run. */
+  size_t released;      /* Sectors released so far. */
+  bool deferred;        /* Sectors were counted by free_map_defer(). */
+};
 
-  if (level == 0) {
-    free_map_release(entry, 1);
+/* Releases the pending run of BATCH, if any. */
+static void release_flush(struct release_batch *batch) {
+  if (batch->cnt == 0)
+    return;
+  if (batch->deferred)
+    free_map_release_deferred(batch->start, batch->cnt, 0);
+  else
+    free_map_release(batch->start, batch->cnt);
+  batch->released += batch->cnt;
+  batch->cnt = 0;
+}
+
+/* Adds SECTOR to BATCH. */
+static void release_add(struct release_batch *batch, block_sector_t sector) {
+  if (batch->cnt > 0 && sector == batch->start + batch->cnt) {
+    batch->cnt++;
     return;
   }
+  release_flush(batch);
+  batch->start = sector;
+  batch->cnt = 1;
+}
+
+/* Releases the indirect block tree at ENTRY, which is LEVEL levels
+   high and maps NUM_SECTORS data sectors, into BATCH.  Each indirect
+   block goes before the sectors it maps, which is how
+   inode_reserve() lays them out. */
+static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
+                                      int level,
+                                      struct release_batch *batch) {
+  ASSERT(level <= 2 + INODE_MAX_DEPTH);
+
+  release_add(batch, entry);
+  if (level == 0)
+    return;
 
   struct inode_indirect_block_sector indirect_block;
   buffer_cache_read(entry, &indirect_block);
 
-  size_t unit = (level == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR);
+  size_t unit = tree_capacity(level - 1);
   size_t i, l = DIV_ROUND_UP(num_sectors, unit);
 
   for (i = 0; i < l; ++i) {
     size_t subsize = min(num_sectors, unit);
-    inode_deallocate_indirect(indirect_block.blocks[i], subsize, level - 1);
+    inode_deallocate_indirect(indirect_block.blocks[i], subsize, level - 1,
+                              batch);
     num_sectors -= subsize;
   }
 
   ASSERT(num_sectors == 0);
-  free_map_release(entry, 1);
 }
 
-static bool inode_deallocate(struct inode *inode) {
-  offset_t file_length = inode->data.length; // bytes
-  if (file_length < 0)
+/* Moves the inline data of INODE into a regular data sector, so that
+   the file can grow past INODE_INLINE_SIZE bytes. */
+static bool inode_spill_inline(struct inode *inode) {
+  struct inode_disk *disk_inode = &inode->data;
+  uint8_t data[BLOCK_SECTOR_SIZE];
+
+  memset(data, 0, BLOCK_SECTOR_SIZE);
+  memcpy(data, disk_inode->inline_data, INODE_INLINE_SIZE);
+  memset(disk_inode->inline_data, 0, INODE_INLINE_SIZE);
+  disk_inode->flags &= ~INODE_INLINE;
+
+  if (!inode_reserve_run(disk_inode, 0, disk_length(disk_inode),
+                         inode->sector)) {
+    memcpy(disk_inode->inline_data, data, INODE_INLINE_SIZE);
+    disk_inode->flags |= INODE_INLINE;
     return false;
+  }
+  if (disk_length(disk_inode) > 0)
+    buffer_cache_write(disk_inode->direct_blocks[0], data);
+  buffer_cache_write(inode->sector, disk_inode);
+  return free_map_flush();
+}
 
+/* Adds the DATA_SECTORS data sectors of DISK_INODE and its indirect
+   block sectors to BATCH. */
+static void release_blocks(const struct inode_disk *disk_inode,
+                           size_t data_sectors, struct release_batch *batch) {
   // (remaining) number of sectors, occupied by this file.
-  size_t num_sectors = bytes_to_sectors(file_length);
+  size_t num_sectors = data_sectors;
   size_t i, l;
 
   // (1) direct blocks
   l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
   for (i = 0; i < l; ++i) {
-    free_map_release(inode->data.direct_blocks[i], 1);
+    release_add(batch, disk_inode->direct_blocks[i]);
   }
   num_sectors -= l;
 
   // (2) a single indirect block
   l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
   if (l > 0) {
-    inode_deallocate_indirect(inode->data.indirect_block, l, 1);
+    inode_deallocate_indirect(disk_inode->indirect_block, l, 1, batch);
     num_sectors -= l;
   }
 
-  // (3) a single doubly indirect block
-  l = min(num_sectors,
-          1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
+  // (3) a doubly indirect tree
+  l = min(num_sectors, tree_capacity(tree_levels(disk_inode)));
   if (l > 0) {
-    inode_deallocate_indirect(inode->data.doubly_indirect_block, l, 2);
+    inode_deallocate_indirect(disk_inode->doubly_indirect_block, l,
+                              tree_levels(disk_inode), batch);
     num_sectors -= l;
   }
 
   ASSERT(num_sectors == 0);
-  return true;
 }
 
-block_sector_t *get_inode_data_sectors(struct inode *inode) {
-  offset_t file_length = inode->data.length; // bytes
-  if (file_length < 0)
-    return false;
+/* Frees the inode sector of removed INODE and all of its data and
+   indirect block sectors, a run of consecutive sectors at a time.
+   DEFERRED is true if the sectors were counted by free_map_defer().
+   Returns the number of sectors freed. */
+static size_t inode_deallocate(struct inode *inode, bool deferred) {
+  struct release_batch batch = {0, 0, 0, deferred};
+  size_t data_sectors = inode_data_sectors(inode);
+
+  release_add(&batch, inode->sector);
+  release_blocks(&inode->data, data_sectors, &batch);
+  release_flush(&batch);
+
+  // settle any difference from the estimate made by inode_reclaim()
+  if (deferred) {
+    size_t estimate = 1 + data_sectors + map_sectors(data_sectors);
+    if (estimate > batch.released)
+      free_map_release_deferred(0, 0, estimate - batch.released);
+  }
+  return batch.released;
+}
+
+/* Replaces the whole contents of INODE with the LENGTH bytes in
+   BUFFER, written to newly allocated sectors, and then frees the
+   old ones.  This is how a file shrinks.  Returns true if
+   successful, false, leaving INODE as it was, if out of disk
+   space. */
+bool inode_rewrite(struct inode *inode, const void *buffer_,
+                   offset_t length) {
+  const uint8_t *buffer = buffer_;
+  struct inode_disk old = inode->data;
+  struct inode_disk *disk_inode = &inode->data;
+  struct release_batch batch = {0, 0, 0, false};
+  offset_t ofs;
+
+  memset(disk_inode->inline_data, 0, INODE_INLINE_SIZE);
+  disk_inode->depth = 0;
+  disk_set_length(disk_inode, length);
+  if (length <= (offset_t)INODE_INLINE_SIZE) {
+    disk_inode->flags |= INODE_INLINE;
+    memcpy(disk_inode->inline_data, buffer, length);
+  } else {
+    disk_inode->flags &= ~INODE_INLINE;
+    if (!inode_reserve_run(disk_inode, 0, length, inode->sector)) {
+      inode->data = old;
+      return false;
+    }
+    for (ofs = 0; ofs < length; ofs += BLOCK_SECTOR_SIZE) {
+      block_sector_t sector = byte_to_sector(inode, ofs);
+      if (length - ofs >= BLOCK_SECTOR_SIZE) {
+        buffer_cache_write(sector, buffer + ofs);
+      } else {
+        uint8_t bounce[BLOCK_SECTOR_SIZE];
+        memset(bounce, 0, BLOCK_SECTOR_SIZE);
+        memcpy(bounce, buffer + ofs, length - ofs);
+        buffer_cache_write(sector, bounce);
+      }
+    }
+  }
+  buffer_cache_write(inode->sector, disk_inode);
+
+  if (!(old.flags & INODE_INLINE))
+    release_blocks(&old, bytes_to_sectors(disk_length(&old)), &batch);
+  release_flush(&batch);
+  return free_map_flush();
+}
+
+/* Appends the NUM_SECTORS data sectors mapped by the indirect block
+   tree at ENTRY, which is LEVEL levels high, to SECTORS[*CUR_I]. */
+static void collect_indirect(block_sector_t entry, size_t num_sectors,
+                             int level, block_sector_t *sectors,
+                             size_t *cur_i) {
+  if (level == 0) {
+    sectors[(*cur_i)++] = entry;
+    return;
+  }
+
+  struct inode_indirect_block_sector indirect_block;
+  buffer_cache_read(entry, &indirect_block);
+
+  size_t unit = tree_capacity(level - 1);
+  size_t i, l = DIV_ROUND_UP(num_sectors, unit);
+
+  for (i = 0; i < l; ++i) {
+    size_t subsize = min(num_sectors, unit);
+    collect_indirect(indirect_block.blocks[i], subsize, level - 1, sectors,
+                     cur_i);
+    num_sectors -= subsize;
+  }
+}
 
+block_sector_t *get_inode_data_sectors(struct inode *inode) {
   // (remaining) number of sectors, occupied by this file.
-  size_t num_sectors = bytes_to_sectors(file_length);
+  size_t num_sectors = inode_data_sectors(inode);
   size_t i, l;
 
   size_t cur_i = 0;
   block_sector_t *sectors = malloc(num_sectors * sizeof(block_sector_t));
   // (1) direct blocks
   l = min(num_sectors, DIRECT_BLOCKS_COUNT * 1);
-  // printf("direct blocks: %d\n", l);
   for (i = 0; i < l; ++i) {
     sectors[cur_i] = inode->data.direct_blocks[i];
     cur_i += 1;
@@ -529,51 +1098,391 @@ block_sector_t *get_inode_data_sectors(struct inode *inode) {
 
   // (2) a single indirect block
   l = min(num_sectors, 1 * INDIRECT_BLOCKS_PER_SECTOR);
-  // printf("indirect blocks: %d\n", l);
   if (l > 0) {
-    struct inode_indirect_block_sector indirect_block;
-    buffer_cache_read(inode->data.indirect_block, &indirect_block);
-    size_t unit = 1;
-    size_t i, l2 = DIV_ROUND_UP(l, unit);
-    for (i = 0; i < l2; ++i) {
-      sectors[cur_i] = indirect_block.blocks[i];
-      cur_i += 1;
-    }
+    collect_indirect(inode->data.indirect_block, l, 1, sectors, &cur_i);
     num_sectors -= l;
   }
 
-  // (3) a single doubly indirect block
-  l = min(num_sectors,
-          1 * INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-  // printf("doubly indirect blocks: %d\n", l);
+  // (3) a doubly indirect tree
+  l = min(num_sectors, tree_capacity(tree_levels(&inode->data)));
   if (l > 0) {
-    struct inode_indirect_block_sector indirect_block;
-    buffer_cache_read(inode->data.doubly_indirect_block, &indirect_block);
-    
-    size_t unit = INDIRECT_BLOCKS_PER_SECTOR;
-    size_t i, l2 = DIV_ROUND_UP(l, unit);
+    collect_indirect(inode->data.doubly_indirect_block, l,
+                     tree_levels(&inode->data), sectors, &cur_i);
+    num_sectors -= l;
+  }
 
-    size_t num_sectors2 = l;
-    for (i = 0; i < l2; ++i) {
-      size_t subsize = min(num_sectors2, unit);
+  ASSERT(num_sectors == 0);
+  return sectors;
+}
 
-      struct inode_indirect_block_sector indirect_block2;
-      buffer_cache_read(indirect_block.blocks[i], &indirect_block2);
+/* qsort() comparator for sector numbers. */
+static int sector_cmp(const void *a_, const void *b_) {
+  block_sector_t a = *(const block_sector_t *)a_;
+  block_sector_t b = *(const block_sector_t *)b_;
+  return a < b ? -1 : a > b;
+}
 
-      size_t unit2 = 1;
-      size_t i2, l3 = DIV_ROUND_UP(subsize, unit2);
+/* Indirect blocks inode_map_extents() keeps on the stack when given
+   no scratch map: one sector's worth. */
+#define EXTENT_WALK_STACK_CNT 128
+
+/* Runs of consecutive data sectors, built up one sector at a time.
+   A run carries on over the file's own indirect blocks, which
+   inode_reserve() lays out between the data sectors they map. */
+struct extent_walk {
+  inode_extent_func *func; /* Called for each finished run. */
+  void *aux;
+  block_sector_t start; /* First sector of the current run. */
+  size_t len;           /* Its length on disk, 0 before any. */
+  size_t cnt;           /* Its data sectors. */
+  block_sector_t *map;  /* The file's indirect blocks, sorted. */
+  size_t map_cnt, map_cap;
+  struct inode_extent_map *scratch; /* Holds MAP, or null if fixed. */
+};
 
-      for (i2 = 0; i2 < l3; ++i2) {
-        sectors[cur_i] = indirect_block2.blocks[i2];
-        cur_i += 1;
-      }
+/* Adds indirect block SECTOR to the map of W, growing the scratch
+   map if need be.  If the map is full and cannot grow, runs are
+   simply no longer bridged over the sectors left out. */
+static void extent_walk_add_map(struct extent_walk *w, block_sector_t sector) {
+  if (w->map_cnt == w->map_cap) {
+    size_t cap = w->map_cap > 0 ? 2 * w->map_cap : 64;
+    block_sector_t *bigger;
+
+    if (w->scratch == NULL)
+      return;
+    bigger = realloc(w->map, cap * sizeof *bigger);
+    if (bigger == NULL)
+      return;
+    w->map = w->scratch->sectors = bigger;
+    w->map_cap = w->scratch->cap = cap;
+  }
+  w->map[w->map_cnt++] = sector;
+}
 
-      num_sectors2 -= subsize;
+/* Adds the indirect blocks of the tree at ENTRY, which is LEVEL (at
+   least 1) levels high and maps NUM_SECTORS data sectors, to the map
+   of W.  Blocks of level 1 map data only, so they are not read. */
+static void extent_walk_collect(struct extent_walk *w, block_sector_t entry,
+                                size_t num_sectors, int level) {
+  struct inode_indirect_block_sector indirect_block;
+  size_t unit = tree_capacity(level - 1), i;
+
+  extent_walk_add_map(w, entry);
+  if (level == 1)
+    return;
+  buffer_cache_read(entry, &indirect_block);
+  for (i = 0; num_sectors > 0; i++) {
+    size_t subsize = min(num_sectors, unit);
+    extent_walk_collect(w, indirect_block.blocks[i], subsize, level - 1);
+    num_sectors -= subsize;
+  }
+}
+
+/* Returns true if the sectors [FROM, TO) are all indirect blocks in
+   the map of W. */
+static bool extent_walk_is_map(const struct extent_walk *w,
+                               block_sector_t from, block_sector_t to) {
+  size_t lo = 0, hi = w->map_cnt, i;
+
+  // first entry not below FROM
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (w->map[mid] < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (i = 0; from + i < to; i++)
+    if (lo + i >= w->map_cnt || w->map[lo + i] != from + i)
+      return false;
+  return true;
+}
+
+/* Adds data sector SECTOR, the next one in file order, to W. */
+static void extent_walk_add(struct extent_walk *w, block_sector_t sector) {
+  if (w->len > 0) {
+    block_sector_t end = w->start + w->len;
+    if (sector >= end && extent_walk_is_map(w, end, sector)) {
+      w->len += sector - end + 1;
+      w->cnt++;
+      return;
     }
+    w->func(w->start, w->len, w->cnt, w->aux);
+  }
+  w->start = sector;
+  w->len = w->cnt = 1;
+}
 
+/* Adds the NUM_SECTORS data sectors mapped by the indirect block
+   tree at ENTRY, which is LEVEL (at least 1) levels high, to W. */
+static void extent_walk_indirect(struct extent_walk *w, block_sector_t entry,
+                                 size_t num_sectors, int level) {
+  struct inode_indirect_block_sector indirect_block;
+  size_t unit = tree_capacity(level - 1), i;
+
+  buffer_cache_read(entry, &indirect_block);
+  for (i = 0; num_sectors > 0; i++) {
+    size_t subsize = min(num_sectors, unit);
+    if (level == 1)
+      extent_walk_add(w, indirect_block.blocks[i]);
+    else
+      extent_walk_indirect(w, indirect_block.blocks[i], subsize, level - 1);
+    num_sectors -= subsize;
+  }
+}
+
+/* Calls FUNC with AUX for each run of consecutive data sectors of
+   the inode at SECTOR, in file order, from its block map alone: file
+   data is not read.  The inode's own indirect blocks do not break a
+   run where they sit between its data sectors, so a file laid out
+   in one piece is one run.  Returns false if SECTOR does not hold an
+   inode.
+
+   The indirect blocks are sorted in SCRATCH, which is only grown
+   when a file has more of them than it holds, so that one scratch
+   map reused over many files allocates for the largest alone.  With
+   a null SCRATCH nothing is allocated: an array on the stack holds
+   the first EXTENT_WALK_STACK_CNT, enough for files of up to 8 MB,
+   and runs of larger files may break where others sit. */
+bool inode_map_extents(block_sector_t sector, inode_extent_func *func,
+                       void *aux, struct inode_extent_map *scratch) {
+  block_sector_t stack[EXTENT_WALK_STACK_CNT];
+  struct extent_walk w = {func, aux, 0, 0, 0, stack, 0,
+                          EXTENT_WALK_STACK_CNT, scratch};
+  struct hash_elem *e;
+  struct inode key;
+  struct inode_disk disk_inode;
+  const struct inode_disk *data = &disk_inode;
+  size_t num_sectors, l, i;
+
+  if (scratch != NULL) {
+    w.map = scratch->sectors;
+    w.map_cap = scratch->cap;
+  }
+  key.sector = sector;
+  e = hash_find(&open_inodes, &key.elem);
+  if (e != NULL)
+    data = &hash_entry(e, struct inode, elem)->data;
+  else
+    buffer_cache_read(sector, &disk_inode);
+  if (data->magic != INODE_MAGIC)
+    return false;
+  if (data->flags & INODE_INLINE)
+    return true;
+  num_sectors = bytes_to_sectors(disk_length(data));
+
+  // the indirect blocks first, so that runs can bridge them
+  if (num_sectors > DIRECT_BLOCKS_COUNT) {
+    l = num_sectors - DIRECT_BLOCKS_COUNT;
+    extent_walk_add_map(&w, data->indirect_block);
+    if (l > INDIRECT_BLOCKS_PER_SECTOR)
+      extent_walk_collect(&w, data->doubly_indirect_block,
+                          l - INDIRECT_BLOCKS_PER_SECTOR, tree_levels(data));
+    qsort(w.map, w.map_cnt, sizeof *w.map, sector_cmp);
+  }
+
+  l = min(num_sectors, DIRECT_BLOCKS_COUNT);
+  for (i = 0; i < l; i++)
+    extent_walk_add(&w, data->direct_blocks[i]);
+  num_sectors -= l;
+
+  l = min(num_sectors, INDIRECT_BLOCKS_PER_SECTOR);
+  if (l > 0) {
+    extent_walk_indirect(&w, data->indirect_block, l, 1);
     num_sectors -= l;
   }
 
-  ASSERT(num_sectors == 0);
-  return sectors;
+  if (num_sectors > 0)
+    extent_walk_indirect(&w, data->doubly_indirect_block, num_sectors,
+                         tree_levels(data));
+
+  if (w.len > 0)
+    func(w.start, w.len, w.cnt, aux);
+  return true;
+}
+
+/* Frees the memory held by SCRATCH, which may then be reused. */
+void inode_extent_map_free(struct inode_extent_map *scratch) {
+  free(scratch->sectors);
+  scratch->sectors = NULL;
+  scratch->cap = 0;
+}
+
+/* inode_map_extents() callback counting runs into the size_t AUX. */
+static void count_extent(block_sector_t start UNUSED, size_t len UNUSED,
+                         size_t cnt UNUSED, void *aux) {
+  (*(size_t *)aux)++;
+}
+
+/* Moves the data sectors and block map of INODE to a single run of
+   free sectors, laid out the way inode_reserve() lays out a new
+   file, copying the data a sector at a time.  Returns true if
+   successful, false if INODE has no data sectors, is in one run
+   already (so moving it would gain nothing), may not be written,
+   or no free run is long enough.
+
+   The image is consistent at every step, so that an interruption
+   can at worst leak sectors: the new run is marked in use in the
+   free map file before anything refers to it, the data and the new
+   block map reach the disk before the inode sector is rewritten to
+   point at them, and the old sectors are only freed after that. */
+bool inode_relocate(struct inode *inode) {
+  size_t num_sectors = inode_data_sectors(inode);
+  struct release_batch batch = {0, 0, 0, false};
+  struct inode_disk old = inode->data, moved = inode->data;
+  size_t cnt = num_sectors + map_sectors(num_sectors);
+  struct sector_run run = {0, cnt, 0, false};
+  block_sector_t start;
+  uint8_t data[BLOCK_SECTOR_SIZE];
+  size_t extents = 0, i;
+
+  if (num_sectors == 0 || inode->deny_write_cnt)
+    return false;
+  // without scratch, a map too big for the stack can only split runs
+  inode_map_extents(inode->sector, count_extent, &extents, NULL);
+  if (extents <= 1)
+    return false;
+  if (!free_map_allocate_best(cnt, &start))
+    return false;
+  run.next = start;
+
+  // the new block map, all taken from the run, with data sectors
+  // left as they are until the copy below
+  memset(moved.direct_blocks, 0, sizeof moved.direct_blocks);
+  moved.indirect_block = 0;
+  moved.doubly_indirect_block = 0;
+  moved.depth = 0;
+  if (!inode_reserve(&moved, 0, disk_length(&moved), &run) || run.left != 0 ||
+      !free_map_flush()) {
+    free_map_release(start, cnt);
+    return false;
+  }
+
+  for (i = 0; i < num_sectors; i++) {
+    buffer_cache_read(index_to_sector(&old, i), data);
+    buffer_cache_write(index_to_sector(&moved, i), data);
+  }
+  buffer_cache_sync();
+
+  inode->data = moved;
+  buffer_cache_write(inode->sector, &inode->data);
+  buffer_cache_sync();
+
+  release_blocks(&old, num_sectors, &batch);
+  release_flush(&batch);
+  free_map_flush();
+  return true;
+}
+
+/* The sectors of a removed inode, gathered by inode_recover(). */
+struct recover_walk {
+  block_sector_t *sectors;
+  size_t cnt, cap;
+  bool ok; /* False once a sector is out of range or in use. */
+};
+
+/* Adds SECTOR to W, or fails W if SECTOR cannot belong to a removed
+   file: if it is past the end of the device or in use again. */
+static void recover_walk_add(struct recover_walk *w, block_sector_t sector) {
+  if (!w->ok)
+    return;
+  if (sector == 0 || sector >= block_size(fs_device) ||
+      free_map_in_use(sector)) {
+    w->ok = false;
+    return;
+  }
+  if (w->cnt == w->cap) {
+    size_t cap = w->cap > 0 ? 2 * w->cap : 64;
+    block_sector_t *bigger = realloc(w->sectors, cap * sizeof *bigger);
+    if (bigger == NULL) {
+      w->ok = false;
+      return;
+    }
+    w->sectors = bigger;
+    w->cap = cap;
+  }
+  w->sectors[w->cnt++] = sector;
+}
+
+/* Adds the indirect block tree at ENTRY, which is LEVEL levels high
+   and maps NUM_SECTORS data sectors, to W.  An indirect block is
+   only read once it has been added, so never from past the end of
+   the device. */
+static void recover_walk_indirect(struct recover_walk *w, block_sector_t entry,
+                                  size_t num_sectors, int level) {
+  struct inode_indirect_block_sector indirect_block;
+  size_t unit, i;
+
+  recover_walk_add(w, entry);
+  if (!w->ok || level == 0)
+    return;
+
+  buffer_cache_read(entry, &indirect_block);
+  unit = tree_capacity(level - 1);
+  for (i = 0; num_sectors > 0 && w->ok; i++) {
+    size_t subsize = min(num_sectors, unit);
+    recover_walk_indirect(w, indirect_block.blocks[i], subsize, level - 1);
+    num_sectors -= subsize;
+  }
+}
+
+/* Brings back the removed inode at SECTOR, a free sector: checks
+   that it is a file's inode whose block map is intact and whose
+   sectors are all still free and claimed once, then marks the
+   inode, its data and its indirect blocks in use in the free map
+   and flushes it.  Returns true if successful, false, changing
+   nothing, if SECTOR fails any of the checks. */
+bool inode_recover(block_sector_t sector) {
+  struct recover_walk w = {NULL, 0, 0, true};
+  struct inode_disk data;
+  size_t num_sectors, l, i, run;
+
+  buffer_cache_read(sector, &data);
+  if (data.magic != INODE_MAGIC || (data.flags & INODE_INTERNAL) ||
+      data.depth > INODE_MAX_DEPTH)
+    return false;
+
+  recover_walk_add(&w, sector);
+  num_sectors = (data.flags & INODE_INLINE)
+                    ? 0
+                    : bytes_to_sectors(disk_length(&data));
+  if (num_sectors > block_size(fs_device))
+    w.ok = false;
+
+  l = min(num_sectors, DIRECT_BLOCKS_COUNT);
+  for (i = 0; i < l && w.ok; i++)
+    recover_walk_add(&w, data.direct_blocks[i]);
+  num_sectors -= l;
+
+  l = min(num_sectors, INDIRECT_BLOCKS_PER_SECTOR);
+  if (l > 0 && w.ok)
+    recover_walk_indirect(&w, data.indirect_block, l, 1);
+  num_sectors -= l;
+
+  if (num_sectors > tree_capacity(tree_levels(&data)))
+    w.ok = false;
+  if (num_sectors > 0 && w.ok)
+    recover_walk_indirect(&w, data.doubly_indirect_block, num_sectors,
+                          tree_levels(&data));
+
+  // a sector mapped twice would be handed out twice
+  if (w.ok) {
+    qsort(w.sectors, w.cnt, sizeof *w.sectors, sector_cmp);
+    for (i = 1; i < w.cnt && w.ok; i++)
+      if (w.sectors[i] == w.sectors[i - 1])
+        w.ok = false;
+  }
+
+  if (w.ok) {
+    for (i = 0; i < w.cnt; i += run) {
+      for (run = 1; i + run < w.cnt &&
+                    w.sectors[i + run] == w.sectors[i] + run;
+           run++)
+        continue;
+      free_map_mark(w.sectors[i], run);
+    }
+    w.ok = free_map_flush();
+  }
+  free(w.sectors);
+  return w.ok;
 }
@@ -2,7 +2,7 @@
 #define FILESYS_INODE_H
 
 #include "block.h"
-#include "list.h"
+#include "hash.h"
 #include "off_t.h"
 #include <stdbool.h>
 
@@ -12,28 +12,51 @@
 #define DIRECT_BLOCKS_COUNT 123
 #define INDIRECT_BLOCKS_PER_SECTOR 128
 
+/* Bytes of file data that fit in the block map area of an inode. */
+#define INODE_INLINE_SIZE ((DIRECT_BLOCKS_COUNT + 2) * sizeof(block_sector_t))
+
+/* Levels the doubly indirect tree may grow by, once it is full.
+   At the maximum it maps more sectors than a device can hold. */
+#define INODE_MAX_DEPTH 3
+
+/* Flags in inode_disk.flags. */
+#define INODE_INLINE 0x01   /* Data is stored in inline_data. */
+#define INODE_INTERNAL 0x02 /* File system metadata, never recovered. */
+
 struct bitmap;
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk {
-  /** Data sectors */
-  block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
-  block_sector_t indirect_block;
-  block_sector_t doubly_indirect_block;
+  union {
+    /** Data sectors */
+    struct {
+      block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
+      block_sector_t indirect_block;
+      block_sector_t doubly_indirect_block; /* Root of the top tree. */
+    };
+    /** Data of small files, if INODE_INLINE is set. */
+    uint8_t inline_data[INODE_INLINE_SIZE];
+  };
 
   bool is_dir;
-  offset_t length; /* File size in bytes. */
-  unsigned magic;  /* Magic number. */
+  uint8_t flags;      /* INODE_* flags, zero in older images. */
+  uint8_t depth;      /* Levels above a doubly indirect tree. */
+  uint8_t length_hi;  /* Bits 32-39 of the file size. */
+  uint32_t length_lo; /* Bits 0-31 of the file size, in bytes. */
+  unsigned magic;     /* Magic number. */
 };
 
 /* In-memory inode. */
 struct inode {
-  struct list_elem elem;  /* Element in inode list. */
+  struct hash_elem elem;  /* Element in open_inodes table. */
+  struct list_elem lru_elem; /* Element in closed_inodes, if not open. */
   block_sector_t sector;  /* Sector number of disk location. */
   int open_cnt;           /* Number of openers. */
   bool removed;           /* True if deleted, false otherwise. */
   int deny_write_cnt;     /* 0: writes ok, >0: deny writes. */
+  block_sector_t alloc_hint; /* Directories: where the next file goes. */
+  block_sector_t checked_index; /* Directories: index found sound, or 0. */
   struct inode_disk data; /* Inode content. */
 };
 
@@ -42,18 +65,46 @@ bool inode_create(block_sector_t, offset_t, bool);
 struct inode *inode_open(block_sector_t);
 struct inode *inode_reopen(struct inode *);
 block_sector_t inode_get_inumber(const struct inode *);
+block_sector_t inode_alloc_hint(const struct inode *);
+void inode_set_alloc_hint(struct inode *, block_sector_t);
+block_sector_t inode_checked_index(const struct inode *);
+void inode_set_checked_index(struct inode *, block_sector_t);
 void inode_close(struct inode *);
 void inode_remove(struct inode *);
 offset_t inode_read_at(struct inode *, void *, offset_t size, offset_t offset);
 offset_t inode_write_at(struct inode *, const void *, offset_t size,
                         offset_t offset);
+bool inode_fallocate(struct inode *, offset_t length);
+bool inode_relocate(struct inode *);
+bool inode_rewrite(struct inode *, const void *, offset_t length);
 void inode_deny_write(struct inode *);
 void inode_allow_write(struct inode *);
 offset_t inode_length(const struct inode *);
 bool inode_is_directory(const struct inode *);
 bool inode_is_removed(const struct inode *);
+bool inode_stat(block_sector_t, offset_t *length, bool *is_dir);
+void inode_reclaim_wait(void);
+bool inode_is_inline(const struct inode *);
+void inode_set_internal(struct inode *);
+bool inode_is_internal(const struct inode *);
 size_t bytes_to_sectors(offset_t size);
+size_t inode_data_sectors(const struct inode *);
 
 block_sector_t *get_inode_data_sectors(struct inode *);
 
+/* Receives a run of LEN consecutive sectors from START, CNT of which
+   are data sectors and the rest the file's own indirect blocks. */
+typedef void inode_extent_func(block_sector_t start, size_t len, size_t cnt,
+                               void *aux);
+/* Scratch space in which inode_map_extents() sorts a file's indirect
+   blocks, grown as needed.  Zero it before first use. */
+struct inode_extent_map {
+  block_sector_t *sectors;
+  size_t cap;
+};
+bool inode_map_extents(block_sector_t, inode_extent_func *, void *aux,
+                       struct inode_extent_map *scratch);
+void inode_extent_map_free(struct inode_extent_map *);
+bool inode_recover(block_sector_t);
+
 #endif /* fs/inode.h */
@@ -151,5 +151,13 @@ static void partition_write(void *p_, block_sector_t sector,
   block_write(p->block, p->start + sector + 1, buffer);
 }
 
-static struct block_operations partition_operations = {partition_read,
-                                                       partition_write};
+/* Reads the CNT sectors from SECTOR on partition P into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes. */
+static void partition_read_run(void *p_, block_sector_t sector, size_t cnt,
+                               void *buffer) {
+  struct partition *p = p_;
+  block_read_run(p->block, p->start + sector + 1, cnt, buffer);
+}
+
+static struct block_operations partition_operations = {
+    partition_read, partition_write, partition_read_run};
@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include "fs/block.h"
+#include "fs/content-index.h"
 #include "fs/filesys.h"
 #include "fs/fsutil.h"
 #include "fs/fsutil2.h"
@@ -211,7 +212,7 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
   } else if (strcmp(command_args[0], "create") == 0) { // rm
     if (args_size != 3)
       return handle_error(TOO_MANY_TOKENS);
-    int size = atoi(command_args[2]);
+    offset_t size = strtoll(command_args[2], NULL, 10);
     int status = fsutil_create(command_args[1], size);
     if (status == 0)
       return handle_error(FILE_CREATION_ERROR);
@@ -234,19 +235,26 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
       current_ind += 1;
     }
     buf[current_ind - 1] = '\0';
-    int bytes_written = fsutil_write(command_args[1], buf, size);
+    offset_t bytes_written = fsutil_write(command_args[1], buf, size);
     free(buf);
     if (bytes_written == -1) {
       return handle_error(FILE_WRITE_ERROR);
     } else if (bytes_written != size) {
-      printf("Warning: could only write %d out of %d bytes (reached end of "
-             "file)\n",
+      printf("Warning: could only write %" PROTd " out of %d bytes (reached "
+             "end of file)\n",
              bytes_written, size);
     }
     return 0;
   } else if (strcmp(command_args[0], "find_file") == 0) { // rm
     if (args_size < 2)
       return handle_error(TOO_FEW_TOKENS);
+    // find_file -m PATTERN... : files containing any of the patterns
+    if (strcmp(command_args[1], "-m") == 0) {
+      if (args_size < 3)
+        return handle_error(TOO_FEW_TOKENS);
+      find_files(command_args + 2, args_size - 2);
+      return 0;
+    }
     int size = 0;
     for (int i = 1; i < args_size; i++) {
       size += strlen(command_args[i]);
@@ -269,10 +277,12 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
   } else if (strcmp(command_args[0], "read") == 0) { // rm
     if (args_size != 3)
       return handle_error(TOO_MANY_TOKENS);
-    int size = atoi(command_args[2]);
-    char *buffer = malloc((size + 1) * sizeof(char));
+    offset_t size = strtoll(command_args[2], NULL, 10);
+    char *buffer = size >= 0 ? malloc((size + 1) * sizeof(char)) : NULL;
+    if (buffer == NULL)
+      return handle_error(FILE_READ_ERROR);
     memset(buffer, 0, (size + 1));
-    int bytes_read = fsutil_read(command_args[1], buffer, size);
+    offset_t bytes_read = fsutil_read(command_args[1], buffer, size);
     if (bytes_read == -1) {
       free(buffer);
       return handle_error(FILE_READ_ERROR);
@@ -296,40 +306,115 @@ int interpreter(char *command_args[], int args_size, char *cwd) {
     if (status != 0)
       return handle_error(status);
     return 0;
+  } else if (strcmp(command_args[0], "copy_in_dir") == 0) {
+    if (args_size != 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    int status = copy_in_dir(command_args[1]);
+    if (status != 0)
+      return handle_error(status);
+    return 0;
+  } else if (strcmp(command_args[0], "copy_out_dir") == 0) {
+    if (args_size != 2)
+      return handle_error(TOO_MANY_TOKENS);
+
+    int status = copy_out_dir(command_args[1]);
+    if (status != 0)
+      return handle_error(status);
+    return 0;
   } else if (strcmp(command_args[0], "size") == 0) { // rm
     if (args_size != 2)
       return handle_error(TOO_MANY_TOKENS);
-    int length = fsutil_size(command_args[1]);
+    offset_t length = fsutil_size(command_args[1]);
     if (length == -1) {
       return handle_error(FILE_DOES_NOT_EXIST);
     }
-    printf("File length: %d\n", length);
+    printf("File length: %" PROTd "\n", length);
     return 0;
   } else if (strcmp(command_args[0], "seek") == 0) { // rm
     if (args_size != 3)
       return handle_error(TOO_MANY_TOKENS);
-    int offset = atoi(command_args[2]);
+    offset_t offset = strtoll(command_args[2], NULL, 10);
     int status = fsutil_seek(command_args[1], offset);
     if (status == -1) {
       return handle_error(FILE_DOES_NOT_EXIST);
     }
     return 0;
+  } else if (strcmp(command_args[0], "fallocate") == 0) {
+    if (args_size != 3)
+      return handle_error(TOO_MANY_TOKENS);
+    offset_t size = strtoll(command_args[2], NULL, 10);
+    int status = fsutil_fallocate(command_args[1], size);
+    if (status == -1)
+      return handle_error(FILE_DOES_NOT_EXIST);
+    if (status == 0)
+      return handle_error(FILE_WRITE_ERROR);
+    return 0;
   } else if (strcmp(command_args[0], "freespace") == 0) { // rm
     if (args_size != 1)
       return handle_error(TOO_MANY_TOKENS);
     int free_space = fsutil_freespace();
-    printf("Num free sectors: %d (%d total bytes)\n", free_space,
-           free_space * BLOCK_SECTOR_SIZE);
+    printf("Num free sectors: %d (%lld total bytes)\n", free_space,
+           (long long)free_space * BLOCK_SECTOR_SIZE);
+    return 0;
+  } else if (strcmp(command_args[0], "stats") == 0) {
+    if (args_size != 1)
+      return handle_error(TOO_MANY_TOKENS);
+    fsutil_stats();
+    return 0;
+  } else if (strcmp(command_args[0], "content_index") == 0) {
+    // content_index build|drop|stats : manage the find_file index
+    if (args_size != 2)
+      return handle_error(args_size < 2 ? TOO_FEW_TOKENS : TOO_MANY_TOKENS);
+    if (strcmp(command_args[1], "build") == 0) {
+      int status = build_content_index();
+      if (status != 0)
+        return handle_error(status);
+    } else if (strcmp(command_args[1], "drop") == 0) {
+      content_index_drop();
+    } else if (strcmp(command_args[1], "stats") == 0) {
+      content_index_print_stats();
+    } else {
+      return handle_error(BAD_COMMAND);
+    }
     return 0;
   } else if (strcmp(command_args[0], "fragmentation_degree") == 0) { // rm
     if (args_size != 1)
       return handle_error(TOO_MANY_TOKENS);
     fragmentation_degree();
     return 0;
-  } else if (strcmp(command_args[0], "defragment") == 0) { // rm
+  } else if (strcmp(command_args[0], "fragmentation_report") == 0) {
     if (args_size != 1)
       return handle_error(TOO_MANY_TOKENS);
-    defragment();
+    fragmentation_report();
+    return 0;
+  } else if (strcmp(command_args[0], "defragment") == 0) { // rm
+    // defragment [--budget <N>ms|<N>] : everything, or a slice of at
+    // most N milliseconds or N data sectors
+    // defragment --idle <N>ms|off : slices of N milliseconds whenever
+    // the shell is left waiting for input
+    if (args_size == 1) {
+      defragment();
+      return 0;
+    }
+    if (args_size != 3)
+      return handle_error(args_size < 3 ? TOO_FEW_TOKENS : TOO_MANY_TOKENS);
+    char *unit;
+    unsigned long amount = strtoul(command_args[2], &unit, 10);
+    bool ms = strcmp(unit, "ms") == 0;
+    if (strcmp(command_args[1], "--idle") == 0 &&
+        strcmp(command_args[2], "off") == 0) {
+      defragment_set_idle(0);
+    } else if (unit == command_args[2] || (*unit != '\0' && !ms) ||
+               amount == 0) {
+      return handle_error(BAD_COMMAND);
+    } else if (strcmp(command_args[1], "--budget") == 0) {
+      defragment_budget(ms ? 0 : amount, ms ? amount : 0);
+    } else if (strcmp(command_args[1], "--idle") == 0) {
+      defragment_set_idle(amount);
+    } else {
+      return handle_error(BAD_COMMAND);
+    }
     return 0;
   } else if (strcmp(command_args[0], "recover") == 0) { // rm
     if (args_size != 2)
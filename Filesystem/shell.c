@@ -1,4 +1,5 @@
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,7 @@
 #include <unistd.h>
 
 #include "fs/filesys.h"
+#include "fs/fsutil2.h"
 #include "fs/ide.h"
 #include "interpreter.h"
 #include "kernel.h"
@@ -16,7 +18,12 @@
 
 #define DEBUG_MODE false
 
+// After this long without input, an interactive shell spends its idle
+// time on defragmentation slices (see "defragment --idle")
+#define DEFRAG_IDLE_WAIT_MS 1000
+
 int parseInput(char ui[], char *cwd);
+void waitForInput();
 
 // Start of everything
 int main(int argc, char *argv[])
@@ -84,7 +91,11 @@ int main(int argc, char *argv[])
         if (!DEBUG_MODE)
         {
             if (isatty(fileno(stdin)))
+            {
                 printf("%c ", prompt);
+                fflush(stdout);
+                waitForInput();
+            }
 
             fgets(userInput, MAX_USER_INPUT - 1, stdin);
 
@@ -171,3 +182,15 @@ int parseInput(char ui[], char *cwd)
 
     return ret;
 }
+
+// Waits for a line on stdin, running slices of idle defragmentation
+// once the user has been away for DEFRAG_IDLE_WAIT_MS, back to back
+// until input arrives or there is nothing left to do
+void waitForInput()
+{
+    struct pollfd pfd = {fileno(stdin), POLLIN, 0};
+    int wait_ms = DEFRAG_IDLE_WAIT_MS;
+
+    while (poll(&pfd, 1, wait_ms) == 0 && defragment_idle())
+        wait_ms = 0;
+}